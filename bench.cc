@@ -0,0 +1,246 @@
+/*
+	线程池性能测试
+	g++ -std=c++20 -O2 -pthread bench.cc -o bench && ./bench [记录数量]
+*/
+
+#include "pipeline.hpp"
+
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <chrono>
+
+using Clock = std::chrono::steady_clock;
+
+// 生成的一条文本记录和每个阶段的处理结果
+struct Record
+{
+	std::string line;
+	uint64_t id = 0;
+	uint64_t key = 0;
+	uint64_t value = 0;
+	uint64_t hash = 0;
+};
+
+// 生成第i条记录的文本 "id,key,value"
+static void makeLine(uint64_t i, std::string& line)
+{
+	line = std::to_string(i);
+	line += ',';
+	line += std::to_string(i * 2654435761u % 1024);
+	line += ',';
+	line += std::to_string(i * 40503u % 100000);
+}
+
+// 解析阶段：把文本拆成三个字段
+static void parseRecord(Record& r)
+{
+	const char* p = r.line.c_str();
+	char* end;
+	r.id = std::strtoull(p, &end, 10);
+	r.key = std::strtoull(end + 1, &end, 10);
+	r.value = std::strtoull(end + 1, &end, 10);
+}
+
+// 变换阶段：模拟一段CPU计算
+static void transformRecord(Record& r)
+{
+	uint64_t h = r.value ^ 0x9e3779b97f4a7c15ull;
+	for (int i = 0; i < 200; ++i)
+	{
+		h ^= h >> 33;
+		h *= 0xff51afd7ed558ccdull;
+	}
+	r.hash = h;
+}
+
+static double elapsedMs(Clock::time_point begin)
+{
+	return std::chrono::duration<double, std::milli>(Clock::now() - begin).count();
+}
+
+// 单线程处理，作为对照并校验流水线的结果
+static void benchSerial(uint64_t count, uint64_t& sum, uint64_t& checksum)
+{
+	auto begin = Clock::now();
+	Record r;
+	sum = 0;
+	checksum = 0;
+	for (uint64_t i = 0; i < count; ++i)
+	{
+		makeLine(i, r.line);
+		parseRecord(r);
+		transformRecord(r);
+		sum += r.hash % 1000;
+		checksum = checksum * 31 + r.id;
+	}
+	double ms = elapsedMs(begin);
+	std::printf("%-28s %10.1f ms %10.0f records/s\n", "serial", ms, count / ms * 1000);
+}
+
+// 流水线：生成(串行) -> 解析(并行) -> 变换(并行) -> 汇总(串行乱序) -> 校验(串行按顺序)
+static void benchPipeline(ThreadPool& pool, uint64_t count, size_t maxTokens,
+	uint64_t expectSum, uint64_t expectChecksum)
+{
+	uint64_t sum = 0;
+	uint64_t checksum = 0;
+	uint64_t next = 0;
+
+	Pipeline<Record> pipeline(pool, maxTokens);
+	pipeline.addStage(StageMode::MODE_PARALLEL, parseRecord)
+		.addStage(StageMode::MODE_PARALLEL, transformRecord)
+		.addStage(StageMode::MODE_SERIAL_OUT_OF_ORDER, [&sum](Record& r) {
+			sum += r.hash % 1000;
+		})
+		.addStage(StageMode::MODE_SERIAL_IN_ORDER, [&checksum](Record& r) {
+			checksum = checksum * 31 + r.id;
+		});
+
+	auto begin = Clock::now();
+	size_t processed = pipeline.run([&next, count](Record& r) -> bool {
+		if (next == count)
+			return false;
+		makeLine(next++, r.line);
+		return true;
+	});
+	double ms = elapsedMs(begin);
+
+	char name[64];
+	std::snprintf(name, sizeof(name), "pipeline tokens=%zu", maxTokens);
+	std::printf("%-28s %10.1f ms %10.0f records/s %s\n", name, ms, processed / ms * 1000,
+		sum == expectSum && checksum == expectChecksum && processed == count ? "ok" : "MISMATCH");
+}
+
+// 提交count个空任务并等待全部完成，测试任务队列、空闲等待和任务类型的开销
+template<typename Pool>
+static void benchSubmit(const char* name, uint64_t count)
+{
+	Pool pool;
+	pool.start();
+
+	std::vector<std::future<void>> results;
+	results.reserve(count);
+	std::atomic<uint64_t> sum{ 0 };
+
+	auto begin = Clock::now();
+	for (uint64_t i = 0; i < count; ++i)
+	{
+		results.emplace_back(pool.submitTask([&sum, i]() {
+			sum.fetch_add(i, std::memory_order_relaxed);
+		}));
+	}
+	for (auto& result : results)
+	{
+		result.get();
+	}
+	double ms = elapsedMs(begin);
+	std::printf("%-28s %10.1f ms %10.0f tasks/s\n", name, ms, count / ms * 1000);
+}
+
+static double elapsedUs(Clock::time_point begin, Clock::time_point end)
+{
+	return std::chrono::duration<double, std::micro>(end - begin).count();
+}
+
+// 按照standbySize设置线程参数，等后台线程创建完备用线程再开始计时
+// 没有备用线程时也等同样的时间，CPU从空闲状态唤醒的开销两边一样，对比才公平
+static void setStandby(ThreadPool& pool, int standbySize)
+{
+	ThreadOptions options;
+	options.standbySize = standbySize;
+	options.name = "bench-";
+	pool.setThreadOptions(options);
+	std::this_thread::sleep_for(std::chrono::milliseconds(20));
+}
+
+// 从调用start到第一个任务开始执行的时间
+static void benchStartup(const char* name, int standbySize, int rounds)
+{
+	double total = 0;
+	for (int i = 0; i < rounds; ++i)
+	{
+		ThreadPool pool;
+		setStandby(pool, standbySize);
+
+		auto begin = Clock::now();
+		pool.start();
+		auto runTime = pool.submitTask([]() { return Clock::now(); }).get();
+		total += elapsedUs(begin, runTime);
+	}
+	std::printf("%-28s %10.1f us first task\n", name, total / rounds);
+}
+
+// cached模式下唯一的线程被占住，再提交一个任务，测量扩容时submitTask的耗时和任务开始执行的时间
+static void benchGrowth(const char* name, int standbySize, int rounds)
+{
+	double submitTotal = 0;
+	double runTotal = 0;
+	for (int i = 0; i < rounds; ++i)
+	{
+		ThreadPool pool;
+		setStandby(pool, standbySize);
+		pool.setMode(PoolMode::MODE_CACHED);
+		pool.start(1);
+
+		std::atomic_bool isBusy{ false };
+		std::atomic_bool isRelease{ false };
+		auto blocker = pool.submitTask([&isBusy, &isRelease]() {
+			isBusy = true;
+			while (!isRelease)
+				std::this_thread::yield();
+			});
+		while (!isBusy)
+			std::this_thread::yield();
+
+		auto begin = Clock::now();
+		auto result = pool.submitTask([]() { return Clock::now(); });
+		auto submitted = Clock::now();
+		auto runTime = result.get();
+		isRelease = true;
+		blocker.get();
+
+		submitTotal += elapsedUs(begin, submitted);
+		runTotal += elapsedUs(begin, runTime);
+	}
+	std::printf("%-28s %10.1f us submit %10.1f us first run\n", name, submitTotal / rounds, runTotal / rounds);
+}
+
+int main(int argc, char** argv)
+{
+	uint64_t count = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 1000000;
+
+	// 线程池在std::cout上打印调试信息，测试时关掉，结果用printf输出
+	std::cout.setstate(std::ios::failbit);
+
+	std::printf("records: %llu, threads: %d\n", static_cast<unsigned long long>(count), THREAD_SIZE);
+
+	uint64_t sum, checksum;
+	benchSerial(count, sum, checksum);
+
+	{
+		ThreadPool pool;
+		pool.start();
+		for (size_t tokens : { 4, 16, 64, 256 })
+		{
+			benchPipeline(pool, count, tokens, sum, checksum);
+		}
+	}
+
+	// 默认的线程池和各个编译期策略组合的对比
+	std::printf("\n");
+	benchSubmit<ThreadPool>("submit default", count);
+	benchSubmit<BasicThreadPool<StdQueuePolicy, ParkIdlePolicy, std::function<void()>, NoStatsPolicy>>(
+		"submit no stats", count);
+	benchSubmit<BasicThreadPool<RingQueuePolicy<>, ParkIdlePolicy, UniqueTask, NoStatsPolicy>>(
+		"submit ring+unique", count);
+	benchSubmit<BasicThreadPool<RingQueuePolicy<>, SpinParkIdlePolicy<>, UniqueTask, NoStatsPolicy>>(
+		"submit ring+unique+spin", count);
+
+	// 启动和cached模式扩容的延迟，对比在锁内创建线程和唤醒预先创建的备用线程
+	std::printf("\n");
+	benchStartup("startup", 0, 100);
+	benchStartup("startup standby", THREAD_SIZE, 100);
+	benchGrowth("cached growth", 0, 100);
+	benchGrowth("cached growth standby", 2, 100);
+	return 0;
+}
@@ -0,0 +1,449 @@
+#pragma once
+/*
+	流水线：在线程池上按阶段处理数据流
+*/
+
+#include "threadpool.hpp"
+
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <exception>
+
+// 流水线阶段的执行方式
+enum class StageMode
+{
+	MODE_SERIAL_IN_ORDER,		// 串行，按照source产生数据的顺序处理
+	MODE_SERIAL_OUT_OF_ORDER,	// 串行，先到先处理
+	MODE_PARALLEL				// 并行，多个线程同时处理
+};
+
+// 有界无锁的多生产者多消费者队列（Dmitry Vyukov的算法），容量会向上取整为2的幂
+template<typename T>
+class BoundedChannel
+{
+public:
+	BoundedChannel(size_t capacity)
+	{
+		size_t size = 2;
+		while (size < capacity)
+			size <<= 1;
+		buffer_ = std::make_unique<Cell[]>(size);
+		mask_ = size - 1;
+		for (size_t i = 0; i < size; ++i)
+		{
+			buffer_[i].seq_.store(i, std::memory_order_relaxed);
+		}
+		enqueuePos_.store(0, std::memory_order_relaxed);
+		dequeuePos_.store(0, std::memory_order_relaxed);
+	}
+
+	BoundedChannel(const BoundedChannel&) = delete;
+	BoundedChannel& operator=(const BoundedChannel&) = delete;
+
+	// 放入一个数据，队列满了返回false
+	bool push(T data)
+	{
+		size_t pos = enqueuePos_.load(std::memory_order_relaxed);
+		Cell* cell;
+		while (true)
+		{
+			cell = &buffer_[pos & mask_];
+			size_t seq = cell->seq_.load(std::memory_order_acquire);
+			intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+			if (diff == 0)
+			{
+				if (enqueuePos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+					break;
+			}
+			else if (diff < 0)
+			{
+				return false;
+			}
+			else
+			{
+				pos = enqueuePos_.load(std::memory_order_relaxed);
+			}
+		}
+		cell->data_ = std::move(data);
+		cell->seq_.store(pos + 1, std::memory_order_release);
+		return true;
+	}
+
+	// 取出一个数据，队列空了返回false
+	bool pop(T& data)
+	{
+		size_t pos = dequeuePos_.load(std::memory_order_relaxed);
+		Cell* cell;
+		while (true)
+		{
+			cell = &buffer_[pos & mask_];
+			size_t seq = cell->seq_.load(std::memory_order_acquire);
+			intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos + 1);
+			if (diff == 0)
+			{
+				if (dequeuePos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+					break;
+			}
+			else if (diff < 0)
+			{
+				return false;
+			}
+			else
+			{
+				pos = dequeuePos_.load(std::memory_order_relaxed);
+			}
+		}
+		data = std::move(cell->data_);
+		cell->seq_.store(pos + mask_ + 1, std::memory_order_release);
+		return true;
+	}
+
+	// 队列是否为空，并发时只是一个瞬间的快照
+	bool empty() const
+	{
+		size_t pos = dequeuePos_.load(std::memory_order_seq_cst);
+		return buffer_[pos & mask_].seq_.load(std::memory_order_seq_cst) != pos + 1;
+	}
+private:
+	struct Cell
+	{
+		std::atomic<size_t> seq_;
+		T data_;
+	};
+
+	std::unique_ptr<Cell[]> buffer_;
+	size_t mask_;
+	alignas(64) std::atomic<size_t> enqueuePos_;	// 生产者和消费者的位置放在不同的缓存行
+	alignas(64) std::atomic<size_t> dequeuePos_;
+};
+
+// 流水线：source串行地产生数据，数据依次经过每个阶段
+// 同时在流水线中的数据不超过maxTokens个，source会等有数据处理完再继续产生，起到流控的作用
+// 取到数据的线程会尽量带着它走完后面的阶段，串行阶段被占用时才把数据放进这个阶段的队列
+// T是每个数据的类型，需要可以默认构造，数据对象会被重复使用；Pool可以是任意BasicThreadPool的实例
+// run不能在同一个线程池的任务中调用，否则可能没有线程执行流水线
+// 线程池的任务队列最好不设上限：队列满时提交会先等待1秒，失败后在当前线程执行，结果正确但很慢
+template<typename T, typename Pool = ThreadPool>
+class Pipeline
+{
+public:
+	Pipeline(Pool& pool, size_t maxTokens = THREAD_SIZE * 4)
+		: pool_(pool)
+		, maxTokens_(maxTokens > 0 ? maxTokens : 1)
+		, freeItems_(maxTokens_)
+		, items_(maxTokens_)
+		, isSourceBusy_(false)
+		, isEnded_(false)
+		, isFailed_(false)
+		, sourceSeq_(0)
+		, processedSize_(0)
+		, pumpSize_(0)
+		, pendingSize_(0)
+	{}
+
+	Pipeline(const Pipeline&) = delete;
+	Pipeline& operator=(const Pipeline&) = delete;
+
+	// 在流水线末尾添加一个阶段
+	Pipeline& addStage(StageMode mode, std::function<void(T&)> func)
+	{
+		stages_.emplace_back(std::make_unique<Stage>(mode, std::move(func), maxTokens_));
+		return *this;
+	}
+
+	// 运行流水线，source往参数里填数据，没有数据时返回false
+	// 阻塞到所有数据处理完，返回处理的数据数量；阶段或者source抛出的第一个异常会在这里重新抛出
+	size_t run(std::function<bool(T&)> source)
+	{
+		source_ = std::move(source);
+		isEnded_ = false;
+		isFailed_ = false;
+		error_ = nullptr;
+		sourceSeq_ = 0;
+		processedSize_ = 0;
+		for (auto& stage : stages_)
+		{
+			stage->nextSeq_ = 0;
+		}
+		Item* item;
+		while (freeItems_.pop(item))
+		{
+		}
+		for (auto& it : items_)
+		{
+			freeItems_.push(&it);
+		}
+
+		schedulePump();
+
+		std::unique_lock<std::mutex> lock(doneMtx_);
+		doneCond_.wait(lock, [this]() -> bool {
+			return pendingSize_ == 0;
+			});
+		if (error_)
+			std::rethrow_exception(error_);
+		return processedSize_;
+	}
+private:
+	// 流水线中的一个数据，seq_是source产生它的顺序
+	struct Item
+	{
+		T value_{};
+		size_t seq_ = 0;
+	};
+
+	// 一个阶段，串行阶段用isBusy_保证同一时间只有一个线程在处理
+	struct Stage
+	{
+		Stage(StageMode mode, std::function<void(T&)> func, size_t maxTokens)
+			: mode_(mode)
+			, func_(std::move(func))
+			, channel_(maxTokens)
+			, slots_(std::make_unique<std::atomic<Item*>[]>(maxTokens))
+			, slotSize_(maxTokens)
+			, isBusy_(false)
+			, nextSeq_(0)
+		{
+			for (size_t i = 0; i < slotSize_; ++i)
+			{
+				slots_[i].store(nullptr, std::memory_order_relaxed);
+			}
+		}
+
+		// 把数据交给串行阶段
+		// 在流水线中的数据不超过maxTokens个，按顺序处理时seq % maxTokens不会冲突
+		void put(Item* item)
+		{
+			if (mode_ == StageMode::MODE_SERIAL_IN_ORDER)
+				slots_[item->seq_ % slotSize_].store(item, std::memory_order_release);
+			else
+				channel_.push(item);
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+		}
+
+		// 尝试占用串行阶段并取一个可以处理的数据，阶段被占用或者没有数据时返回nullptr
+		Item* tryTake()
+		{
+			while (true)
+			{
+				if (isBusy_.exchange(true, std::memory_order_acquire))
+					return nullptr;
+
+				Item* item = nullptr;
+				if (mode_ == StageMode::MODE_SERIAL_IN_ORDER)
+					item = slots_[nextSeq_.load(std::memory_order_relaxed) % slotSize_].exchange(nullptr, std::memory_order_acquire);
+				else
+					channel_.pop(item);
+				if (item != nullptr)
+					return item;
+
+				// 释放之后再检查一次，防止刚好有数据在释放前放进来却没有线程处理
+				isBusy_.store(false, std::memory_order_release);
+				std::atomic_thread_fence(std::memory_order_seq_cst);
+				if (!hasReady())
+					return nullptr;
+			}
+		}
+
+		// 处理完一个数据后释放串行阶段，返回是否还有等待处理的数据
+		bool release()
+		{
+			if (mode_ == StageMode::MODE_SERIAL_IN_ORDER)
+				nextSeq_.fetch_add(1, std::memory_order_relaxed);
+			isBusy_.store(false, std::memory_order_release);
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			return hasReady();
+		}
+
+		// 是否有可以处理的数据
+		bool hasReady() const
+		{
+			if (mode_ == StageMode::MODE_SERIAL_IN_ORDER)
+				return slots_[nextSeq_.load(std::memory_order_relaxed) % slotSize_].load(std::memory_order_acquire) != nullptr;
+			return !channel_.empty();
+		}
+
+		StageMode mode_;
+		std::function<void(T&)> func_;
+		BoundedChannel<Item*> channel_;						// 先到先处理的串行阶段的等待队列
+		std::unique_ptr<std::atomic<Item*>[]> slots_;		// 按顺序处理的串行阶段的重排缓冲区
+		size_t slotSize_;
+		std::atomic_bool isBusy_;
+		std::atomic<size_t> nextSeq_;						// 按顺序处理时下一个要处理的seq
+	};
+
+	// 从第stage个阶段开始处理数据，item为nullptr时只处理这个阶段中等待的数据
+	void runFrom(Item* item, size_t stage)
+	{
+		bool needPut = item != nullptr;
+		while (stage < stages_.size())
+		{
+			Stage& st = *stages_[stage];
+			bool isSerial = st.mode_ != StageMode::MODE_PARALLEL;
+			if (isSerial)
+			{
+				if (needPut)
+					st.put(item);
+				// 阶段被别的线程占用，数据留给占用的线程处理
+				item = st.tryTake();
+				if (item == nullptr)
+					return;
+			}
+
+			// 出错之后剩下的数据只是走完流水线，保证按顺序的阶段不会卡住
+			if (!isFailed_.load(std::memory_order_relaxed))
+			{
+				try
+				{
+					st.func_(item->value_);
+				}
+				catch (...)
+				{
+					setError(std::current_exception());
+				}
+			}
+
+			// 阶段中还有别的数据在等待，交给另一个线程，当前线程继续带着这个数据往下走
+			if (isSerial && st.release())
+				schedule([this, stage]() {
+					runFrom(nullptr, stage);
+					pump();
+				});
+			needPut = true;
+			++stage;
+		}
+
+		// 走完了所有阶段，归还token
+		processedSize_.fetch_add(1, std::memory_order_relaxed);
+		freeItems_.push(item);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+	}
+
+	// 不断从source取数据并带着它走完流水线，直到没有空闲的token或者source结束
+	void pump()
+	{
+		Item* item;
+		while (takeSource(item))
+		{
+			runFrom(item, 0);
+		}
+	}
+
+	// 占用source取一个数据，取不到返回false
+	bool takeSource(Item*& item)
+	{
+		while (true)
+		{
+			if (isSourceBusy_.exchange(true, std::memory_order_acquire))
+				return false;
+			if (!isEnded_ && freeItems_.pop(item))
+				break;
+
+			// 释放之后再检查一次，防止刚好有token归还却没有线程去取数据
+			isSourceBusy_.store(false, std::memory_order_release);
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			if (isEnded_ || freeItems_.empty())
+				return false;
+		}
+
+		bool hasData = false;
+		if (!isFailed_.load(std::memory_order_relaxed))
+		{
+			try
+			{
+				hasData = source_(item->value_);
+			}
+			catch (...)
+			{
+				setError(std::current_exception());
+			}
+		}
+		if (!hasData)
+		{
+			isEnded_ = true;
+			freeItems_.push(item);
+			isSourceBusy_.store(false, std::memory_order_release);
+			return false;
+		}
+
+		item->seq_ = sourceSeq_++;
+		isSourceBusy_.store(false, std::memory_order_release);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+
+		// 还有空闲的token，让另一个线程并行地从source取数据
+		if (!freeItems_.empty())
+			schedulePump();
+		return true;
+	}
+
+	// 提交一个取数据的任务，同时运行的数量不超过maxTokens_
+	void schedulePump()
+	{
+		if (pumpSize_.fetch_add(1, std::memory_order_relaxed) >= maxTokens_)
+		{
+			pumpSize_.fetch_sub(1, std::memory_order_relaxed);
+			return;
+		}
+		schedule([this]() {
+			pump();
+			pumpSize_.fetch_sub(1, std::memory_order_relaxed);
+		});
+	}
+
+	// 把func提交到线程池，run会等待所有提交的任务结束
+	void schedule(std::function<void()> func)
+	{
+		pendingSize_.fetch_add(1, std::memory_order_relaxed);
+		auto task = std::make_shared<std::function<void()>>(std::move(func));
+		auto result = pool_.submitTask([this, task]() {
+			runScheduled(*task);
+			return true;
+		});
+
+		// 任务队列满了提交失败时，线程池直接返回值为false的结果，任务不会执行，改为在当前线程执行
+		if (result.wait_for(std::chrono::seconds(0)) == std::future_status::ready && !result.get())
+			runScheduled(*task);
+	}
+
+	// 执行提交的任务并减少计数
+	void runScheduled(std::function<void()>& func)
+	{
+		func();
+		// 在锁内减少计数，保证run返回、Pipeline析构时这里已经不再访问成员
+		std::unique_lock<std::mutex> lock(doneMtx_);
+		if (pendingSize_.fetch_sub(1, std::memory_order_acq_rel) == 1)
+			doneCond_.notify_all();
+	}
+
+	// 记录第一个异常并停止从source取数据
+	void setError(std::exception_ptr error)
+	{
+		std::unique_lock<std::mutex> lock(doneMtx_);
+		if (!error_)
+			error_ = error;
+		isFailed_ = true;
+	}
+private:
+	Pool& pool_;
+	size_t maxTokens_;										// 同时在流水线中的数据数量上限
+	std::vector<std::unique_ptr<Stage>> stages_;			// 所有阶段
+	std::function<bool(T&)> source_;						// 产生数据的函数
+	BoundedChannel<Item*> freeItems_;						// 空闲的token
+	std::vector<Item> items_;								// 所有的token
+
+	std::atomic_bool isSourceBusy_;							// 是否有线程在调用source_
+	std::atomic_bool isEnded_;								// source_是否已经没有数据
+	std::atomic_bool isFailed_;								// 是否有阶段抛出了异常
+	size_t sourceSeq_;										// 下一个数据的seq，只有占用source的线程访问
+	std::atomic<size_t> processedSize_;						// 已经走完流水线的数据数量
+	std::atomic<size_t> pumpSize_;							// 正在取数据的任务数量
+	std::atomic<size_t> pendingSize_;						// 提交到线程池还没有结束的任务数量
+
+	std::exception_ptr error_;								// 第一个异常
+	std::mutex doneMtx_;
+	std::condition_variable doneCond_;						// 所有任务结束时通知run
+};
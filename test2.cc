@@ -0,0 +1,691 @@
+/*
+	版本二（threadpool.hpp、pipeline.hpp）的测试
+	g++ -std=c++20 -O2 -pthread test2.cc -o test2 && ./test2
+*/
+
+#include "pipeline.hpp"
+
+#include <cstdio>
+#include <chrono>
+#include <stdexcept>
+#include <ctime>
+#include <array>
+#ifdef __linux__
+#include <sys/socket.h>
+#endif
+
+using namespace std::chrono_literals;
+using Clock = std::chrono::steady_clock;
+
+static int failedSize = 0;
+
+// 检查条件，失败时打印出错的位置，最后由main返回失败
+static void check(bool cond, const char* what, int line)
+{
+	if (!cond)
+	{
+		std::printf("FAILED line %d: %s\n", line, what);
+		failedSize++;
+	}
+}
+#define CHECK(cond) check((cond), #cond, __LINE__)
+
+// 等待条件成立，最多等待timeout
+template<typename Pred>
+static bool waitFor(Pred pred, std::chrono::milliseconds timeout = 5000ms)
+{
+	auto deadline = Clock::now() + timeout;
+	while (!pred())
+	{
+		if (Clock::now() > deadline)
+			return false;
+		std::this_thread::sleep_for(1ms);
+	}
+	return true;
+}
+
+// 同时提交count个任务，每个任务执行一段时间，返回同时执行的任务数量的最大值
+template<typename Submit>
+static int maxConcurrency(Submit submit, int count)
+{
+	std::atomic_int running{ 0 };
+	std::atomic_int maxRunning{ 0 };
+	std::vector<std::future<void>> results;
+	for (int i = 0; i < count; ++i)
+	{
+		results.emplace_back(submit([&running, &maxRunning]() {
+			int cur = ++running;
+			int prev = maxRunning.load();
+			while (cur > prev && !maxRunning.compare_exchange_weak(prev, cur))
+				;
+			std::this_thread::sleep_for(20ms);
+			running--;
+		}));
+	}
+	for (auto& result : results)
+	{
+		result.get();
+	}
+	return maxRunning;
+}
+
+// 运行中扩容和缩容
+void testResize()
+{
+	ThreadPool pool;
+	pool.start(1);
+	auto submit = [&pool](auto func) { return pool.submitTask(func); };
+	CHECK(maxConcurrency(submit, 8) == 1);
+
+	pool.setThreadSize(4);
+	CHECK(maxConcurrency(submit, 8) == 4);
+
+	pool.setThreadSize(2);
+	CHECK(maxConcurrency(submit, 8) == 2);
+}
+
+// 运行中切换模式：cached模式按需扩容，切回fixed模式后多出来的线程退出
+void testSetMode()
+{
+	ThreadPool pool;
+	pool.start(2);
+	auto submit = [&pool](auto func) { return pool.submitTask(func); };
+	CHECK(maxConcurrency(submit, 6) == 2);
+
+	pool.setMode(PoolMode::MODE_CACHED);
+	CHECK(maxConcurrency(submit, 6) > 2);
+
+	pool.setMode(PoolMode::MODE_FIXED);
+	CHECK(maxConcurrency(submit, 6) == 2);
+}
+
+// 运行中调低再调高cached模式的线程阈值，核心线程不会退出，排队的任务照常执行
+void testThreshHold()
+{
+	ThreadPool pool;
+	pool.setMode(PoolMode::MODE_CACHED);
+	pool.start(2);
+	auto submit = [&pool](auto func) { return pool.submitTask(func); };
+
+	pool.setThreadMaxThreshHold(0);
+	CHECK(maxConcurrency(submit, 6) == 2);
+	pool.setThreadMaxThreshHold(-5);
+	CHECK(maxConcurrency(submit, 6) == 2);
+
+	// 排队的任务在调低、调高阈值之后照常执行
+	std::atomic_int ranSize{ 0 };
+	std::vector<std::future<void>> results;
+	for (int i = 0; i < 10; ++i)
+	{
+		results.emplace_back(pool.submitTask([&ranSize]() {
+			std::this_thread::sleep_for(5ms);
+			ranSize++;
+			}));
+	}
+	pool.setThreadMaxThreshHold(1);
+	pool.setThreadMaxThreshHold(8);
+	for (auto& result : results)
+	{
+		CHECK(result.wait_for(5s) == std::future_status::ready);
+	}
+	CHECK(ranSize == 10);
+	CHECK(maxConcurrency(submit, 8) > 2);
+}
+
+// 两种关闭方式返回丢弃的任务数量
+void testShutdown()
+{
+	{
+		ThreadPool pool;
+		pool.start(1);
+		std::atomic_bool isStarted{ false };
+		std::atomic_bool isRelease{ false };
+		pool.submitTask([&isStarted, &isRelease]() {
+			isStarted = true;
+			while (!isRelease)
+				std::this_thread::sleep_for(1ms);
+			});
+		std::atomic_int ranSize{ 0 };
+		for (int i = 0; i < 5; ++i)
+		{
+			pool.submitTask([&ranSize]() { ranSize++; });
+		}
+		CHECK(waitFor([&isStarted]() { return isStarted.load(); }));
+
+		std::thread releaser([&isRelease]() {
+			std::this_thread::sleep_for(50ms);
+			isRelease = true;
+			});
+		CHECK(pool.shutdown(ShutdownMode::MODE_CANCEL) == 5);
+		releaser.join();
+		CHECK(ranSize == 0);
+	}
+	{
+		ThreadPool pool;
+		pool.start(1);
+		std::atomic_bool isStarted{ false };
+		pool.submitTask([&isStarted]() {
+			isStarted = true;
+			std::this_thread::sleep_for(200ms);
+			});
+		for (int i = 0; i < 3; ++i)
+		{
+			pool.submitTask([]() {});
+		}
+		CHECK(waitFor([&isStarted]() { return isStarted.load(); }));
+		CHECK(pool.shutdownFor(50ms) == 3);
+	}
+	{
+		// 任务都能在超时前执行完时不丢弃任务
+		ThreadPool pool;
+		pool.start(2);
+		for (int i = 0; i < 10; ++i)
+		{
+			pool.submitTask([]() {});
+		}
+		CHECK(pool.shutdownFor(5s) == 0);
+	}
+}
+
+// 已经取消的任务出队时不执行，future抛出TaskCancelled
+void testCancel()
+{
+	ThreadPool pool;
+	pool.start(1);
+	std::atomic_bool isRelease{ false };
+	pool.submitTask([&isRelease]() {
+		while (!isRelease)
+			std::this_thread::sleep_for(1ms);
+		});
+
+	CancelToken token;
+	std::atomic_bool isRun{ false };
+	auto cancelled = pool.submitTask(token, [&isRun]() { isRun = true; return 1; });
+	auto kept = pool.submitTask(CancelToken(), []() { return 2; });
+	token.cancel();
+	isRelease = true;
+
+	bool isThrown = false;
+	try
+	{
+		cancelled.get();
+	}
+	catch (const TaskCancelled&)
+	{
+		isThrown = true;
+	}
+	CHECK(isThrown);
+	CHECK(!isRun);
+	CHECK(kept.get() == 2);
+}
+
+// 租户的并发上限、DRR轮转和租户释放
+void testTenant()
+{
+	{
+		ThreadPool pool;
+		pool.start(4);
+		auto tenant = pool.createTenant(1, 1);
+		CHECK(maxConcurrency([&tenant](auto func) { return tenant.submitTask(func); }, 6) == 1);
+	}
+	{
+		// 只有一个线程，先占住它，两个租户的任务都排好队再放开
+		ThreadPool pool;
+		pool.start(1);
+		std::atomic_bool isRelease{ false };
+		pool.submitTask([&isRelease]() {
+			while (!isRelease)
+				std::this_thread::sleep_for(1ms);
+			});
+
+		auto heavy = pool.createTenant();
+		auto light = pool.createTenant();
+		std::mutex orderMtx;
+		std::vector<int> order;
+		std::vector<std::future<void>> results;
+		for (int i = 0; i < 100; ++i)
+		{
+			results.emplace_back(heavy.submitTask([&orderMtx, &order]() {
+				std::unique_lock<std::mutex> lock(orderMtx);
+				order.push_back(0);
+				}));
+		}
+		for (int i = 0; i < 10; ++i)
+		{
+			results.emplace_back(light.submitTask([&orderMtx, &order]() {
+				std::unique_lock<std::mutex> lock(orderMtx);
+				order.push_back(1);
+				}));
+		}
+		isRelease = true;
+		for (auto& result : results)
+		{
+			result.get();
+		}
+
+		// 权重相同时两个租户轮流执行，light的10个任务在前20多个任务中就执行完了
+		size_t lastLight = 0;
+		for (size_t i = 0; i < order.size(); ++i)
+		{
+			if (order[i] == 1)
+				lastLight = i;
+		}
+		CHECK(order.size() == 110);
+		CHECK(lastLight < 25);
+	}
+	{
+		// 句柄销毁后租户的任务照常执行
+		ThreadPool pool;
+		pool.start(2);
+		std::atomic_int ranSize{ 0 };
+		for (int i = 0; i < 1000; ++i)
+		{
+			auto tenant = pool.createTenant();
+			tenant.submitTask([&ranSize]() { ranSize++; });
+		}
+		pool.shutdown(ShutdownMode::MODE_DRAIN);
+		CHECK(ranSize == 1000);
+	}
+	{
+		// cached模式下达到并发上限的租户的任务不能执行，不会为它们扩容
+		ThreadPool pool;
+		std::atomic_int createdSize{ 0 };
+		pool.setThreadInitFunc([&createdSize](int) { createdSize++; });
+		pool.setMode(PoolMode::MODE_CACHED);
+		pool.start(1);
+		auto tenant = pool.createTenant(1, 1);
+		std::vector<std::future<void>> results;
+		for (int i = 0; i < 40; ++i)
+		{
+			results.emplace_back(tenant.submitTask([]() { std::this_thread::sleep_for(1ms); }));
+		}
+		for (auto& result : results)
+		{
+			result.get();
+		}
+		CHECK(createdSize <= 2);
+	}
+}
+
+// 阻塞区域创建补偿线程，看门狗报告卡住的任务
+void testBlocking()
+{
+	{
+		// 唯一的线程在阻塞区域里等待后面的任务，补偿线程执行后面的任务，不会死锁
+		ThreadPool pool;
+		pool.start(1);
+		std::atomic_bool isDone{ false };
+		auto waiter = pool.submitTask([&isDone]() {
+			ThreadPool::BlockingRegion region;
+			return waitFor([&isDone]() { return isDone.load(); }, 2000ms);
+			});
+		std::this_thread::sleep_for(20ms);
+		pool.submitTask([&isDone]() { isDone = true; });
+		CHECK(waiter.get());
+	}
+	{
+		// 执行时间超过阈值的任务只报告一次
+		ThreadPool pool;
+		pool.start(2);
+		std::mutex stallMtx;
+		std::vector<StallInfo> stalls;
+		pool.setStallWatchdog(20ms, [&stallMtx, &stalls](const StallInfo& info) {
+			std::unique_lock<std::mutex> lock(stallMtx);
+			stalls.push_back(info);
+			});
+		pool.submitTask([]() {}).get();
+		pool.submitTask([]() { std::this_thread::sleep_for(150ms); }).get();
+
+		std::unique_lock<std::mutex> lock(stallMtx);
+		CHECK(stalls.size() == 1);
+		CHECK(stalls.size() == 1 && stalls[0].taskId == 2 && stalls[0].duration >= 20ms);
+	}
+	{
+		// compensate为true时为卡住的任务创建补偿线程
+		ThreadPool pool;
+		pool.start(1);
+		pool.setStallWatchdog(20ms, [](const StallInfo&) {}, true);
+		std::atomic_bool isDone{ false };
+		auto stuck = pool.submitTask([&isDone]() {
+			return waitFor([&isDone]() { return isDone.load(); }, 2000ms);
+			});
+		std::this_thread::sleep_for(5ms);
+		pool.submitTask([&isDone]() { isDone = true; });
+		CHECK(stuck.get());
+	}
+	{
+		// 阈值为1ms时看门狗也不会空转
+		ThreadPool pool;
+		pool.start(1);
+		pool.setStallWatchdog(1ms, [](const StallInfo&) {});
+		std::clock_t begin = std::clock();
+		std::this_thread::sleep_for(500ms);
+		double cpuMs = 1000.0 * (std::clock() - begin) / CLOCKS_PER_SEC;
+		CHECK(cpuMs < 40);
+	}
+}
+
+// fd就绪时reactor把回调放到线程池执行，回调抛出异常不影响线程池，reactor开启时普通任务也不会被耽误
+void testReactor()
+{
+#ifdef __linux__
+	int fds[2];
+	CHECK(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+	{
+		ThreadPool pool;
+		pool.start(2);
+		CHECK(pool.enableReactor());
+
+		std::promise<uint32_t> ready;
+		CHECK(pool.watchFd(fds[0], EPOLLIN, [&ready](uint32_t events) { ready.set_value(events); }));
+		std::this_thread::sleep_for(20ms);
+		char c = 'x';
+		CHECK(write(fds[1], &c, 1) == 1);
+		auto result = ready.get_future();
+		CHECK(result.wait_for(2s) == std::future_status::ready && (result.get() & EPOLLIN) != 0);
+		pool.unwatchFd(fds[0]);
+
+		// 回调抛出的异常不会终止进程，线程池继续工作
+		std::promise<void> thrown;
+		CHECK(pool.watchFd(fds[0], EPOLLIN, [&thrown](uint32_t) {
+			thrown.set_value();
+			throw std::runtime_error("callback fails");
+			}));
+		auto thrownResult = thrown.get_future();
+		CHECK(thrownResult.wait_for(2s) == std::future_status::ready);
+		CHECK(pool.submitTask([]() { return 4; }).get() == 4);
+		pool.unwatchFd(fds[0]);
+
+		// 一个线程在执行长任务，另一个线程在epoll_wait，新任务要唤醒epoll_wait的线程执行
+		auto begin = Clock::now();
+		auto slow = pool.submitTask([]() { std::this_thread::sleep_for(200ms); });
+		auto fast = pool.submitTask([]() { return Clock::now(); });
+		CHECK(fast.get() - begin < 100ms);
+		slow.get();
+	}
+	close(fds[0]);
+	close(fds[1]);
+
+	{
+		// 等待过的fd关闭之后再等待会失败，不会留下永远不会触发的回调
+		ThreadPool pool;
+		pool.start(1);
+		CHECK(pool.enableReactor());
+		int pipeFds[2];
+		CHECK(pipe(pipeFds) == 0);
+		CHECK(pool.watchFd(pipeFds[0], EPOLLIN, [](uint32_t) {}));
+		close(pipeFds[0]);
+		close(pipeFds[1]);
+		CHECK(!pool.watchFd(pipeFds[0], EPOLLIN, [](uint32_t) {}));
+		CHECK(!pool.watchFd(-1, EPOLLIN, [](uint32_t) {}));
+	}
+#endif
+}
+
+// 任务队列策略的正确性：任务全部执行，只移动的任务和超过内部缓冲区的任务都可以提交
+template<typename Pool>
+void checkPolicyPool()
+{
+	Pool pool;
+	pool.start(2);
+
+	std::atomic<uint64_t> sum{ 0 };
+	std::vector<std::future<void>> results;
+	for (uint64_t i = 0; i < 5000; ++i)
+	{
+		results.emplace_back(pool.submitTask([&sum, i]() { sum += i; }));
+	}
+	for (auto& result : results)
+	{
+		result.get();
+	}
+	CHECK(sum == 4999ull * 5000 / 2);
+
+	auto owned = std::make_unique<int>(6);
+	CHECK(pool.submitTask([owned = std::move(owned)]() { return *owned; }).get() == 6);
+
+	std::array<uint64_t, 64> big{};
+	big[63] = 7;
+	CHECK(pool.submitTask([big]() { return big[63]; }).get() == 7);
+
+	auto tenant = pool.createTenant(2, 1);
+	CHECK(tenant.submitTask([](int a, int b) { return a + b; }, 3, 4).get() == 7);
+
+	// 其他线程池类型也可以运行流水线
+	int next = 0;
+	long total = 0;
+	Pipeline<int, Pool> pipeline(pool, 4);
+	pipeline.addStage(StageMode::MODE_SERIAL_IN_ORDER, [&total](int& x) { total += x; });
+	pipeline.run([&next](int& x) -> bool {
+		if (next == 100)
+			return false;
+		x = next++;
+		return true;
+	});
+	CHECK(total == 99 * 100 / 2);
+}
+
+// 各种编译期策略组合都能正常工作
+void testPolicies()
+{
+	checkPolicyPool<BasicThreadPool<StdQueuePolicy, ParkIdlePolicy, std::function<void()>, NoStatsPolicy>>();
+	checkPolicyPool<BasicThreadPool<StdQueuePolicy, ParkIdlePolicy, UniqueTask, DefaultStatsPolicy>>();
+	// 初始容量很小，测试环形队列扩容
+	checkPolicyPool<BasicThreadPool<RingQueuePolicy<2>, ParkIdlePolicy, UniqueTask, NoStatsPolicy>>();
+	checkPolicyPool<BasicThreadPool<RingQueuePolicy<>, SpinParkIdlePolicy<>, UniqueTask, NoStatsPolicy>>();
+	checkPolicyPool<BasicThreadPool<RingQueuePolicy<>, SpinParkIdlePolicy<100>, std::function<void()>, DefaultStatsPolicy>>();
+}
+
+// 线程初始化和退出回调，以及每个线程一份的WorkerLocal
+struct CounterTag {};
+
+// 线程退出时析构，稍等一会再释放租户的最后一个句柄，释放时需要线程池的锁
+struct TenantHolder
+{
+	~TenantHolder()
+	{
+		std::this_thread::sleep_for(100ms);
+		tenant.reset();
+	}
+	std::optional<ThreadPool::Tenant> tenant;
+};
+
+void testWorkerLocal()
+{
+	{
+		ThreadPool pool;
+		std::mutex idMtx;
+		std::vector<int> initIds;
+		std::vector<int> exitIds;
+		std::atomic_int counted{ 0 };
+		pool.setThreadInitFunc([&idMtx, &initIds](int threadId) {
+			std::unique_lock<std::mutex> lock(idMtx);
+			initIds.push_back(threadId);
+			WorkerLocal<int, CounterTag>::emplace(0);
+			});
+		pool.setThreadExitFunc([&idMtx, &exitIds, &counted](int threadId) {
+			std::unique_lock<std::mutex> lock(idMtx);
+			exitIds.push_back(threadId);
+			counted += WorkerLocal<int, CounterTag>::get();
+			});
+		pool.start(3);
+
+		std::vector<std::future<void>> results;
+		for (int i = 0; i < 300; ++i)
+		{
+			results.emplace_back(pool.submitTask([]() { WorkerLocal<int, CounterTag>::get()++; }));
+		}
+		for (auto& result : results)
+		{
+			result.get();
+		}
+		pool.shutdown(ShutdownMode::MODE_DRAIN);
+
+		std::sort(initIds.begin(), initIds.end());
+		std::sort(exitIds.begin(), exitIds.end());
+		CHECK(initIds.size() == 3);
+		CHECK(initIds == exitIds);
+		CHECK(counted == 300);
+		CHECK((!WorkerLocal<int, CounterTag>::has()));
+	}
+	{
+		// 退出线程的WorkerLocal析构时访问线程池，扩容时不能在持有锁的情况下join这个线程
+		ThreadPool pool;
+		pool.setThreadInitFunc([&pool](int) {
+			WorkerLocal<TenantHolder>::get().tenant = pool.createTenant();
+			});
+		pool.start(2);
+		pool.setThreadSize(1);
+		std::this_thread::sleep_for(20ms);
+		pool.setThreadSize(2);
+		CHECK(pool.submitTask([]() { return 5; }).get() == 5);
+	}
+}
+
+// 流水线按顺序输出，串行乱序阶段不会并发执行，阶段抛出的异常在run中重新抛出
+void testPipeline()
+{
+	ThreadPool pool;
+	pool.start(4);
+	{
+		std::vector<int> output;
+		int next = 0;
+		Pipeline<int> pipeline(pool, 8);
+		pipeline.addStage(StageMode::MODE_PARALLEL, [](int& x) {
+				// 让并行阶段乱序完成
+				std::this_thread::sleep_for(std::chrono::microseconds((x * 37) % 200));
+				x *= 2;
+			})
+			.addStage(StageMode::MODE_SERIAL_IN_ORDER, [&output](int& x) {
+				output.push_back(x);
+			});
+		size_t processed = pipeline.run([&next](int& x) -> bool {
+			if (next == 500)
+				return false;
+			x = next++;
+			return true;
+		});
+
+		bool isOrdered = output.size() == 500;
+		for (size_t i = 0; isOrdered && i < output.size(); ++i)
+		{
+			isOrdered = output[i] == static_cast<int>(i) * 2;
+		}
+		CHECK(processed == 500);
+		CHECK(isOrdered);
+	}
+	{
+		// 串行乱序阶段每次只有一个线程执行，所有数据都经过一次
+		std::atomic_bool isInside{ false };
+		bool isOverlapped = false;
+		long sum = 0;
+		size_t seenSize = 0;
+		int next = 0;
+		Pipeline<int> pipeline(pool, 16);
+		pipeline.addStage(StageMode::MODE_PARALLEL, [](int& x) {
+				std::this_thread::sleep_for(std::chrono::microseconds((x * 53) % 100));
+			})
+			.addStage(StageMode::MODE_SERIAL_OUT_OF_ORDER, [&](int& x) {
+				if (isInside.exchange(true))
+					isOverlapped = true;
+				sum += x;
+				seenSize++;
+				isInside = false;
+			});
+		size_t processed = pipeline.run([&next](int& x) -> bool {
+			if (next == 1000)
+				return false;
+			x = next++;
+			return true;
+		});
+		CHECK(processed == 1000);
+		CHECK(seenSize == 1000);
+		CHECK(sum == 999 * 1000 / 2);
+		CHECK(!isOverlapped);
+	}
+	{
+		int next = 0;
+		Pipeline<int> pipeline(pool, 8);
+		pipeline.addStage(StageMode::MODE_PARALLEL, [](int& x) {
+			if (x == 37)
+				throw std::runtime_error("bad record");
+		});
+		bool isThrown = false;
+		try
+		{
+			pipeline.run([&next](int& x) -> bool {
+				if (next == 500)
+					return false;
+				x = next++;
+				return true;
+			});
+		}
+		catch (const std::runtime_error&)
+		{
+			isThrown = true;
+		}
+		CHECK(isThrown);
+	}
+}
+
+// 创建线程失败时抛出异常，线程池保持关闭，之后可以正常启动和析构
+void testStartFailure()
+{
+#ifdef __linux__
+	ThreadPool pool;
+	ThreadOptions options;
+	options.stackSize = 1ull << 50;
+	pool.setThreadOptions(options);
+	bool isThrown = false;
+	try
+	{
+		pool.start(1);
+	}
+	catch (const std::system_error&)
+	{
+		isThrown = true;
+	}
+	CHECK(isThrown);
+
+	pool.setThreadOptions(ThreadOptions());
+	pool.start(1);
+	CHECK(pool.submitTask([]() { return 3; }).get() == 3);
+#endif
+}
+
+// 备用线程：cached模式扩容时直接唤醒
+void testStandby()
+{
+	ThreadPool pool;
+	ThreadOptions options;
+	options.standbySize = 2;
+	options.name = "test-";
+	pool.setThreadOptions(options);
+	pool.setMode(PoolMode::MODE_CACHED);
+	pool.start(1);
+	auto submit = [&pool](auto func) { return pool.submitTask(func); };
+	CHECK(maxConcurrency(submit, 4) > 1);
+}
+
+int main()
+{
+	// 线程池在std::cout上打印调试信息，测试时关掉
+	std::cout.setstate(std::ios::failbit);
+
+	testResize();
+	testSetMode();
+	testThreshHold();
+	testShutdown();
+	testCancel();
+	testTenant();
+	testBlocking();
+	testReactor();
+	testWorkerLocal();
+	testPipeline();
+	testPolicies();
+	testStartFailure();
+	testStandby();
+
+	std::printf(failedSize == 0 ? "all passed\n" : "%d checks failed\n", failedSize);
+	return failedSize == 0 ? 0 : 1;
+}
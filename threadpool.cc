@@ -6,6 +6,7 @@ ThreadPool::ThreadPool()
 	, idleThreadSize_(0)
 	, curThreadSize_(0)
 	, threadMaxThreshHold_(THREAD_MAX_THRESHHOLD)
+	, exitThreadSize_(0)
 	, taskSize_(0)
 	, taskQueMaxThreshHold_(TASK_MAX_THRESHHOLD)
 	, poolMode_(PoolMode::MODE_FIXED)
@@ -14,39 +15,60 @@ ThreadPool::ThreadPool()
 
 ThreadPool::~ThreadPool()
 {
-	isPoolRunning_ = false;
-
-	std::unique_lock<std::mutex> lock(taskQueMtx_);
-	notEmpty_.notify_all();
-	exitCond_.wait(lock, [this]() -> bool {
-		return threads_.empty();
-		});
-
+	shutdown(ShutdownMode::MODE_DRAIN);
 }
 
 // 设置线程池的工作模式
 void ThreadPool::setMode(PoolMode mode)
 {
-	if (checkRunningState())
-		return;
+	std::unique_lock<std::mutex> lock(taskQueMtx_);
 	poolMode_ = mode;
+	if (!checkRunningState())
+		return;
+
+	// 运行中切换回fixed模式，cached模式下额外创建的线程需要退出
+	if (poolMode_ == PoolMode::MODE_FIXED)
+		adjustThreadSize(initThreadSize_);
+	// 唤醒空闲线程，按照新的模式重新等待任务
+	notEmpty_.notify_all();
 }
 
-// 设置线程池cached模式下线程阈值
+// 设置线程池cached模式下线程阈值，不低于核心线程数量
 void ThreadPool::setThreadMaxThreshHold(int threshhold)
 {
-	if (checkRunningState())
+	std::unique_lock<std::mutex> lock(taskQueMtx_);
+	// 阈值不能低于核心线程数量，否则调低阈值会让核心线程也退出，之后没有线程执行任务
+	threshhold = std::max(threshhold, std::max(static_cast<int>(initThreadSize_), 1));
+	threadMaxThreshHold_ = threshhold;
+	if (!checkRunningState())
 		return;
-	if (poolMode_ == PoolMode::MODE_CACHED)
-		threadMaxThreshHold_ = threshhold;
+
+	// 阈值调低后，超出阈值的线程需要退出
+	if (poolMode_ == PoolMode::MODE_CACHED
+		&& curThreadSize_ - exitThreadSize_ > threshhold)
+		adjustThreadSize(threshhold);
 }
 
 // 设置task任务队列上限阈值
 void ThreadPool::setTaskQueMaxThreshHold(int threshhold)
 {
-	if (checkRunningState())
-		return;
+	std::unique_lock<std::mutex> lock(taskQueMtx_);
 	taskQueMaxThreshHold_ = threshhold;
+	// 阈值调高后，唤醒阻塞在提交任务上的用户线程
+	notFull_.notify_all();
+}
+
+// 设置线程池的线程数量，运行中调用会立即扩容或缩容
+void ThreadPool::setThreadSize(int threadSize)
+{
+	if (threadSize < 1)
+		threadSize = 1;
+
+	std::unique_lock<std::mutex> lock(taskQueMtx_);
+	initThreadSize_ = threadSize;
+	if (!checkRunningState())
+		return;
+	adjustThreadSize(threadSize);
 }
 
 // 给线程池提交任务
@@ -79,37 +101,65 @@ Result ThreadPool::submitTask(std::shared_ptr<Task> sp)
 			&& curThreadSize_ < threadMaxThreshHold_)
 		{
 			std::cout << ">>> create new thread threadId: " << std::this_thread::get_id() << std::endl;
-			auto ptr = std::make_unique<Thread>(std::bind(&ThreadPool::threadFunc, this, std::placeholders::_1));
-			int threadId = ptr->getId();
-			threads_.emplace(threadId, std::move(ptr));
-			threads_[threadId]->start();
-			curThreadSize_++;
+			addThread();
 		}
 
 
 		return Result(sp);
 }
 
-// 开启线程池
+// 开启线程池，关闭之后可以再次调用start重新开启
 void ThreadPool::start(int initThreadSize)
 {
+	std::unique_lock<std::mutex> lock(taskQueMtx_);
+	if (checkRunningState())
+		return;
 	isPoolRunning_ = true;
 	initThreadSize_ = initThreadSize;
-	curThreadSize_ = initThreadSize;
 
+	// 新线程在start返回、释放锁之后才开始取任务
 	for (int i = 0; i < initThreadSize; ++i)
 	{
-		auto ptr = std::make_unique<Thread>(std::bind(&ThreadPool::threadFunc, this, std::placeholders::_1));
-		int threadId = ptr->getId();
-		threads_.emplace(threadId, std::move(ptr));
-		curThreadSize_++;
-		idleThreadSize_++;
+		addThread();
 	}
+}
+
+// 关闭线程池，返回没有执行就被丢弃的任务数量
+size_t ThreadPool::shutdown(ShutdownMode mode)
+{
+	std::unique_lock<std::mutex> lock(taskQueMtx_);
+	stopThreads();
 
-	for (auto& [threadId, thread] : threads_)
+	size_t discardSize = 0;
+	if (mode == ShutdownMode::MODE_CANCEL)
+		discardSize = discardTasks();
+
+	exitCond_.wait(lock, [this]() -> bool {
+		return threads_.empty();
+		});
+	joinThreads(lock);
+	return discardSize;
+}
+
+// 关闭线程池，最多等待timeout让线程执行队列中剩余的任务，超时后丢弃剩余的任务
+size_t ThreadPool::shutdownFor(std::chrono::milliseconds timeout)
+{
+	std::unique_lock<std::mutex> lock(taskQueMtx_);
+	stopThreads();
+
+	size_t discardSize = 0;
+	if (!exitCond_.wait_for(lock, timeout, [this]() -> bool {
+		return threads_.empty();
+		}))
 	{
-		thread->start();
+		// 超时后丢弃还没有开始的任务，正在执行的任务无法打断，只能等待其结束
+		discardSize = discardTasks();
+		exitCond_.wait(lock, [this]() -> bool {
+			return threads_.empty();
+			});
 	}
+	joinThreads(lock);
+	return discardSize;
 }
 
 // 定义线程函数
@@ -126,36 +176,41 @@ void ThreadPool::threadFunc(int threadId)
 		std::cout << "tid: " << std::this_thread::get_id() << " 尝试获取任务..." << std::endl;
 
 
-		while (taskQue_.empty())
+		while (taskQue_.empty() || exitThreadSize_ > 0)
 		{
+			// 线程池缩容，当前线程手上没有任务，直接退出，队列中的任务留给其他线程
+			if (exitThreadSize_ > 0)
+			{
+				exitThreadSize_--;
+				removeThread(threadId);
+				std::cout << "threadid: " << std::this_thread::get_id() << " exit" << std::endl;
+				return;
+			}
+
 			// 回收线程资源
 			if (!isPoolRunning_)
 			{
-				threads_.erase(threadId);
-				exitCond_.notify_all();
+				removeThread(threadId);
 				return;
 			}
 
 			// 如果是cached模式，会根据现在空闲线程等待的时间，如果超过设定的60s，会自动回收线程
+			// 直接等到空闲超时的时间点，关闭线程池时会被notify_all唤醒，不需要轮询
 			if (poolMode_ == PoolMode::MODE_CACHED)
 			{
 				// 表明等待超时
 				if (std::cv_status::timeout ==
-					notEmpty_.wait_for(lock, std::chrono::seconds(1)))
+					notEmpty_.wait_until(lock, lastTime + std::chrono::seconds(THREAD_MAX_IDLE_TIME)))
 				{
-					auto now = std::chrono::high_resolution_clock().now();
-					auto dur = std::chrono::duration_cast<std::chrono::seconds>(now - lastTime);
-					if (dur.count() >= THREAD_MAX_IDLE_TIME
-						&& curThreadSize_ > initThreadSize_)
+					if (curThreadSize_ > initThreadSize_)
 					{
 						// 回收线程资源
-						threads_.erase(threadId);
-						// 修改其他属性
-						curThreadSize_--;
-						idleThreadSize_--;
+						removeThread(threadId);
 						std::cout << "threadid: " << std::this_thread::get_id() << " exit" << std::endl;
 						return;
 					}
+					// 核心线程不回收，重新计时
+					lastTime = std::chrono::high_resolution_clock().now();
 				}
 			}
 			else
@@ -200,6 +255,86 @@ bool ThreadPool::checkRunningState() const
 	return isPoolRunning_;
 }
 
+// 创建并启动一个新线程，调用前需持有taskQueMtx_
+void ThreadPool::addThread()
+{
+	// 顺便回收已经退出的线程，退出的线程不再需要锁，join不会阻塞太久
+	exitThreads_.clear();
+
+	auto ptr = std::make_unique<Thread>(std::bind(&ThreadPool::threadFunc, this, std::placeholders::_1));
+	int threadId = ptr->getId();
+	threads_.emplace(threadId, std::move(ptr));
+	threads_[threadId]->start();
+	curThreadSize_++;
+	idleThreadSize_++;
+}
+
+// 线程退出时把线程对象移到exitThreads_等待join，并修改线程数量，调用前需持有taskQueMtx_
+void ThreadPool::removeThread(int threadId)
+{
+	auto it = threads_.find(threadId);
+	exitThreads_.emplace_back(std::move(it->second));
+	threads_.erase(it);
+	curThreadSize_--;
+	idleThreadSize_--;
+	exitCond_.notify_all();
+}
+
+// 标记线程池停止并唤醒所有线程，调用前需持有taskQueMtx_
+void ThreadPool::stopThreads()
+{
+	isPoolRunning_ = false;
+	exitThreadSize_ = 0;
+	notEmpty_.notify_all();
+	notFull_.notify_all();
+}
+
+// 丢弃队列中还没有执行的任务，返回丢弃的数量，调用前需持有taskQueMtx_
+size_t ThreadPool::discardTasks()
+{
+	size_t discardSize = taskQue_.size();
+	while (!taskQue_.empty())
+	{
+		taskQue_.front()->cancel();
+		taskQue_.pop();
+	}
+	taskSize_ = 0;
+	notFull_.notify_all();
+	return discardSize;
+}
+
+// 在锁外join所有已经退出的线程
+void ThreadPool::joinThreads(std::unique_lock<std::mutex>& lock)
+{
+	std::vector<std::unique_ptr<Thread>> exitThreads;
+	exitThreads.swap(exitThreads_);
+	lock.unlock();
+	exitThreads.clear();
+}
+
+// 把线程数量调整到threadSize，多余的线程标记为待退出，调用前需持有taskQueMtx_
+void ThreadPool::adjustThreadSize(int threadSize)
+{
+	int liveSize = curThreadSize_ - exitThreadSize_;
+	if (threadSize > liveSize)
+	{
+		// 先撤销还没来得及退出的名额，不够再创建新线程
+		int diff = threadSize - liveSize;
+		int revoke = std::min(diff, exitThreadSize_);
+		exitThreadSize_ -= revoke;
+		for (int i = revoke; i < diff; ++i)
+		{
+			addThread();
+		}
+	}
+	else if (threadSize < liveSize)
+	{
+		// 正在执行任务的线程会在任务结束后退出，不会丢失任务
+		exitThreadSize_ += liveSize - threadSize;
+		notEmpty_.notify_all();
+	}
+}
+
 
 /*
 	Thread线程实现
@@ -213,13 +348,21 @@ Thread::Thread(ThreadFunc func)
 
 }
 Thread::~Thread()
-{}
+{
+	join();
+}
 
 // 启动线程
 void Thread::start()
 {
-	std::thread t(func_, threadId_);
-	t.detach();	// 该线程与主线程分离
+	thread_ = std::thread(func_, threadId_);
+}
+
+// 等待线程结束，回收线程资源
+void Thread::join()
+{
+	if (thread_.joinable())
+		thread_.join();
 }
 
 int Thread::getId() const
@@ -237,6 +380,12 @@ void Task::exec()
 		result_->setVal(run());
 }
 
+void Task::cancel()
+{
+	if (result_ != nullptr)
+		result_->setVal(Any());
+}
+
 void Task::setResult(Result* res)
 {
 	result_ = res;
@@ -14,6 +14,7 @@
 #include <thread>
 #include <functional>
 #include <unordered_map>
+#include <chrono>
 
 const int TASK_MAX_THRESHHOLD = INT32_MAX;
 const int THREAD_SIZE = \
@@ -136,6 +137,8 @@ public:
 	Task() = default;
 	~Task() = default;
 	void exec();
+	// 任务被丢弃没有执行，给Result设置一个空的返回值，防止用户一直阻塞在get上
+	void cancel();
 	void setResult(Result* res);
 	// 用户可以自定义任意类型的任务，从Task继承，重写run方法
 	virtual Any run() = 0; 
@@ -150,6 +153,13 @@ enum class PoolMode
 	MODE_CACHED // 线程数量可以动态增长
 };
 
+// 线程池关闭的方式
+enum class ShutdownMode
+{
+	MODE_DRAIN, // 执行完队列中剩余的任务再关闭
+	MODE_CANCEL // 丢弃队列中还没有执行的任务，只等待正在执行的任务
+};
+
 // 线程类型
 class Thread
 {
@@ -163,12 +173,16 @@ public:
 	// 启动线程
 	void start();
 
+	// 等待线程结束，回收线程资源
+	void join();
+
 	// 获取线程id
 	int getId() const;
 private:
 	ThreadFunc func_;
 	static int generateId_;
 	int threadId_;			// 保存线程id
+	std::thread thread_;	// 线程对象，由线程池负责join
 };
 
 // 线程池类型
@@ -181,18 +195,29 @@ public:
 	// 设置线程池的工作模式
 	void setMode(PoolMode mode);
 
-	// 设置线程池cached模式下线程阈值
+	// 设置线程池cached模式下线程阈值，不低于核心线程数量（setThreadSize/start设置的数量）
 	void setThreadMaxThreshHold(int threshhold);
 
 	// 设置task任务队列上限阈值
 	void setTaskQueMaxThreshHold(int threshhold);
 
+	// 设置线程池的线程数量，运行中调用会立即扩容或缩容
+	void setThreadSize(int threadSize);
+
 	// 给线程池提交任务
 	Result submitTask(std::shared_ptr<Task> sp);
 
-	// 开启线程池
+	// 开启线程池，关闭之后可以再次调用start重新开启
 	void start(int initThreadSize = THREAD_SIZE);
 
+	// 关闭线程池，返回没有执行就被丢弃的任务数量
+	// 不能在线程池的任务中调用，否则会一直等待自己退出
+	size_t shutdown(ShutdownMode mode = ShutdownMode::MODE_DRAIN);
+
+	// 关闭线程池，最多等待timeout让线程执行队列中剩余的任务，超时后丢弃剩余的任务
+	// 返回没有执行就被丢弃的任务数量
+	size_t shutdownFor(std::chrono::milliseconds timeout);
+
 	// 禁止拷贝和赋值
 	ThreadPool(const ThreadPool&) = delete;
 	ThreadPool& operator=(const ThreadPool&) = delete;
@@ -203,12 +228,32 @@ private:
 
 	// 检查pool的运行状态
 	bool checkRunningState() const;
+
+	// 创建并启动一个新线程，调用前需持有taskQueMtx_
+	void addThread();
+
+	// 线程退出时把线程对象移到exitThreads_等待join，并修改线程数量，调用前需持有taskQueMtx_
+	void removeThread(int threadId);
+
+	// 标记线程池停止并唤醒所有线程，调用前需持有taskQueMtx_
+	void stopThreads();
+
+	// 丢弃队列中还没有执行的任务，返回丢弃的数量，调用前需持有taskQueMtx_
+	size_t discardTasks();
+
+	// 在锁外join所有已经退出的线程
+	void joinThreads(std::unique_lock<std::mutex>& lock);
+
+	// 把线程数量调整到threadSize，多余的线程标记为待退出，调用前需持有taskQueMtx_
+	void adjustThreadSize(int threadSize);
 private:
 	std::unordered_map<int, std::unique_ptr<Thread>> threads_;		// 线程列表
+	std::vector<std::unique_ptr<Thread>> exitThreads_;				// 已经退出、等待join的线程
 	size_t initThreadSize_;											// 初始的线程数量
 	std::atomic_int curThreadSize_;									// 记录当前线程池的线程数量
 	std::atomic_int idleThreadSize_;								// 空闲线程的数量
 	size_t threadMaxThreshHold_;									// 线程数量上限的阈值
+	int exitThreadSize_;											// 等待退出的线程数量（受taskQueMtx_保护）
 	
 	std::queue<std::shared_ptr<Task>> taskQue_;						// 任务队列
 	std::atomic_uint taskSize_;										// 任务的数量
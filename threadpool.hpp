@@ -15,12 +15,36 @@
 #include <functional>
 #include <unordered_map>
 #include <future>
+#include <exception>
+#include <list>
+#include <deque>
+#include <algorithm>
+#include <cstdint>
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <optional>
+#include <string>
+#include <system_error>
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <climits>
+#include <cerrno>
+#endif
 
 const int TASK_MAX_THRESHHOLD = INT32_MAX;
 const int THREAD_SIZE = \
 std::thread::hardware_concurrency() ? std::thread::hardware_concurrency() : 4;
 const int THREAD_MAX_THRESHHOLD = THREAD_SIZE * 10;
 const int THREAD_MAX_IDLE_TIME = 60; // 单位:秒
+const int THREAD_STANDBY_REFILL_DELAY = 1; // 单位:毫秒
 
 // 线程池支持的模式
 enum class PoolMode
@@ -29,6 +53,60 @@ enum class PoolMode
 	MODE_CACHED // 线程数量可以动态增长
 };
 
+// 线程池关闭的方式
+enum class ShutdownMode
+{
+	MODE_DRAIN, // 执行完队列中剩余的任务再关闭
+	MODE_CANCEL // 丢弃队列中还没有执行的任务，只等待正在执行的任务
+};
+
+// 任务被取消时，future.get()抛出的异常
+class TaskCancelled : public std::exception
+{
+public:
+	const char* what() const noexcept override
+	{
+		return "task is cancelled";
+	}
+};
+
+// 任务取消标记，拷贝之间共享同一个状态
+// 用同一个token提交的一组任务可以一起取消，正在执行的任务也可以通过isCancelled()检查自己是否被取消
+class CancelToken
+{
+public:
+	CancelToken()
+		: cancelled_(std::make_shared<std::atomic_bool>(false))
+	{}
+
+	// 取消这个token下所有的任务，O(1)，还在队列中的任务出队时直接跳过
+	void cancel()
+	{
+		cancelled_->store(true, std::memory_order_release);
+	}
+
+	// 是否已经被取消，只是一次原子读，任务执行中可以频繁检查
+	bool isCancelled() const
+	{
+		return cancelled_->load(std::memory_order_acquire);
+	}
+private:
+	std::shared_ptr<std::atomic_bool> cancelled_;
+};
+
+// 创建线程的参数，除standbySize外都只在Linux上生效，其他平台使用std::thread的默认参数
+struct ThreadOptions
+{
+	size_t stackSize = 0;			// 线程栈大小，0表示使用系统默认值
+	bool isHugePageStack = false;	// 线程栈使用透明大页，减少TLB缺失
+	bool isPrefaultStack = false;	// 创建线程时预先写一遍线程栈，执行任务时不再缺页（线程池中只对备用线程生效）
+	std::string name;				// 线程名前缀，实际的线程名是前缀加线程编号，方便perf、gdb区分线程（最多15个字符）
+	int schedPolicy = -1;			// 调度策略，例如SCHED_FIFO、SCHED_BATCH，-1表示不修改
+	int schedPriority = 0;			// 调度策略对应的优先级
+	int nice = 0;					// 线程的nice值，0表示不修改
+	int standbySize = 0;			// 预先创建并挂起的备用线程数量，线程池扩容时直接唤醒备用线程
+};
+
 // 线程类型
 class Thread
 {
@@ -37,18 +115,74 @@ public:
 	using ThreadFunc = std::function<void(int)>;
 
 	Thread(ThreadFunc func)
-		: func_(func)
+		: func_(std::move(func))
 		, threadId_(generateId_++)
 	{
 
 	}
-	~Thread() = default;
+	~Thread()
+	{
+		join();
+	}
 
-	// 启动线程
-	void start()
+	// 启动线程，创建失败时抛出std::system_error
+	void start(const ThreadOptions& options = ThreadOptions())
 	{
-		std::thread t(func_, threadId_);
-		t.detach();	// 该线程与主线程分离
+#ifdef __linux__
+		pthread_attr_t attr;
+		pthread_attr_init(&attr);
+
+		size_t stackSize = options.stackSize;
+		if (options.isHugePageStack || options.isPrefaultStack)
+		{
+			// 自己分配线程栈，才能在线程启动前设置大页和预先缺页
+			if (stackSize == 0)
+				pthread_attr_getstacksize(&attr, &stackSize);
+			if (allocStack(stackSize, options))
+				pthread_attr_setstack(&attr, stackBase_, stackSize_);
+		}
+		else if (stackSize > 0)
+		{
+			pthread_attr_setstacksize(&attr, std::max<size_t>(stackSize, PTHREAD_STACK_MIN));
+		}
+
+		schedPolicy_ = options.schedPolicy;
+		schedPriority_ = options.schedPriority;
+		nice_ = options.nice;
+		int ret = pthread_create(&tid_, &attr, &Thread::entry, this);
+		pthread_attr_destroy(&attr);
+		if (ret != 0)
+		{
+			freeStack();
+			throw std::system_error(ret, std::generic_category(), "pthread_create");
+		}
+		isStarted_ = true;
+
+		if (!options.name.empty())
+		{
+			std::string name = options.name + std::to_string(threadId_);
+			name.resize(std::min<size_t>(name.size(), 15));
+			pthread_setname_np(tid_, name.c_str());
+		}
+#else
+		thread_ = std::thread(func_, threadId_);
+#endif
+	}
+
+	// 等待线程结束，回收线程资源
+	void join()
+	{
+#ifdef __linux__
+		if (isStarted_)
+		{
+			pthread_join(tid_, nullptr);
+			isStarted_ = false;
+			freeStack();
+		}
+#else
+		if (thread_.joinable())
+			thread_.join();
+#endif
 	}
 
 	// 获取线程id
@@ -57,148 +191,964 @@ public:
 		return threadId_;
 	}
 private:
+#ifdef __linux__
+	// 线程入口，在线程自己身上设置调度策略和nice值
+	// pthread_attr只支持SCHED_FIFO/SCHED_RR，SCHED_BATCH/SCHED_IDLE需要sched_setscheduler
+	// 没有权限（例如非root使用实时调度策略）时保持继承的调度策略
+	static void* entry(void* arg)
+	{
+		Thread* self = static_cast<Thread*>(arg);
+		if (self->schedPolicy_ >= 0)
+		{
+			sched_param param{};
+			param.sched_priority = self->schedPriority_;
+			(void)sched_setscheduler(0, self->schedPolicy_, &param);
+		}
+		if (self->nice_ != 0)
+			(void)setpriority(PRIO_PROCESS, static_cast<id_t>(syscall(SYS_gettid)), self->nice_);
+		self->func_(self->threadId_);
+		return nullptr;
+	}
+
+	// 用mmap分配线程栈，最低的一页作为guard page，失败时返回false，使用系统分配的栈
+	bool allocStack(size_t stackSize, const ThreadOptions& options)
+	{
+		size_t pageSize = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+		size_t size = (std::max<size_t>(stackSize, PTHREAD_STACK_MIN) + pageSize - 1) / pageSize * pageSize;
+		void* addr = mmap(nullptr, size + pageSize, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+		if (addr == MAP_FAILED)
+			return false;
+		(void)mprotect(addr, pageSize, PROT_NONE);
+
+		stackMap_ = addr;
+		stackMapSize_ = size + pageSize;
+		stackBase_ = static_cast<char*>(addr) + pageSize;
+		stackSize_ = size;
+
+		// 先设置大页再缺页，缺页时才能直接分配大页
+		if (options.isHugePageStack)
+			(void)madvise(stackBase_, stackSize_, MADV_HUGEPAGE);
+		if (options.isPrefaultStack)
+		{
+			for (size_t offset = 0; offset < stackSize_; offset += pageSize)
+				static_cast<volatile char*>(stackBase_)[offset] = 0;
+		}
+		return true;
+	}
+
+	void freeStack()
+	{
+		if (stackMap_ != nullptr)
+		{
+			munmap(stackMap_, stackMapSize_);
+			stackMap_ = nullptr;
+		}
+	}
+#endif
+
 	ThreadFunc func_;
-	static int generateId_;
+	static inline std::atomic_int generateId_{ 0 };	// 备用线程在锁外创建，编号需要原子生成
 	int threadId_;			// 保存线程id
+#ifdef __linux__
+	pthread_t tid_{};		// 线程句柄，由线程池负责join
+	bool isStarted_ = false;
+	int schedPolicy_ = -1;
+	int schedPriority_ = 0;
+	int nice_ = 0;
+	void* stackMap_ = nullptr;		// 自己分配的线程栈（包括guard page），nullptr表示由系统分配
+	size_t stackMapSize_ = 0;
+	void* stackBase_ = nullptr;
+	size_t stackSize_ = 0;
+#else
+	std::thread thread_;	// 线程对象，由线程池负责join
+#endif
+};
+
+// 租户的统计信息
+struct TenantStats
+{
+	size_t queueSize;		// 队列中等待的任务数量
+	size_t runningSize;		// 正在执行的任务数量
+	uint64_t finishedSize;	// 已经执行完的任务数量
+	double avgWaitMs;		// 任务在队列中的平均等待时间，单位:毫秒
+	double maxWaitMs;		// 任务在队列中的最长等待时间，单位:毫秒
+};
+
+// 看门狗发现的执行时间过长的任务
+struct StallInfo
+{
+	uint64_t taskId;					// 任务编号，按照提交顺序递增
+	std::chrono::milliseconds duration;	// 任务已经执行的时间
+	int threadId;						// 线程池内部的线程编号
+	std::thread::id tid;				// 执行任务的系统线程id
 };
 
-int Thread::generateId_ = 0;
+// 每个线程一份的T对象，存放在thread_local中，任务里访问不需要查找也不需要加锁
+// 第一次get时默认构造，也可以在线程初始化回调中用emplace构造，线程退出时自动析构
+// 同一个类型需要多份时用不同的Tag区分
+template<typename T, typename Tag = void>
+class WorkerLocal
+{
+public:
+	// 获取当前线程的对象，还没有构造时默认构造一个
+	static T& get()
+	{
+		if (!value_)
+			value_.emplace();
+		return *value_;
+	}
 
-// 线程池类型
-class ThreadPool
+	// 用参数构造当前线程的对象，已经存在的对象会先析构
+	template<typename... Args>
+	static T& emplace(Args&&... args)
+	{
+		return value_.emplace(std::forward<Args>(args)...);
+	}
+
+	// 当前线程是否已经构造了对象
+	static bool has()
+	{
+		return value_.has_value();
+	}
+
+	// 提前析构当前线程的对象，例如在线程退出回调中按照指定的顺序释放资源
+	static void reset()
+	{
+		value_.reset();
+	}
+private:
+	static inline thread_local std::optional<T> value_;
+};
+
+// 只能移动的任务类型，小的可调用对象直接存放在对象内部，不需要分配内存
+// 用它作为任务类型时，packaged_task可以直接放进任务队列，不需要再用shared_ptr包一层
+class UniqueTask
 {
 public:
-	ThreadPool()
+	UniqueTask() = default;
+
+	template<typename Func, typename = std::enable_if_t<!std::is_same_v<std::decay_t<Func>, UniqueTask>>>
+	UniqueTask(Func&& func)
+	{
+		using F = std::decay_t<Func>;
+		if constexpr (sizeof(F) <= BUFFER_SIZE
+			&& alignof(F) <= alignof(std::max_align_t)
+			&& std::is_nothrow_move_constructible_v<F>)
+		{
+			new (buffer_) F(std::forward<Func>(func));
+			ops_ = &inlineOps<F>;
+		}
+		else
+		{
+			*reinterpret_cast<F**>(buffer_) = new F(std::forward<Func>(func));
+			ops_ = &heapOps<F>;
+		}
+	}
+
+	UniqueTask(UniqueTask&& other) noexcept
+	{
+		moveFrom(other);
+	}
+
+	UniqueTask& operator=(UniqueTask&& other) noexcept
+	{
+		if (this != &other)
+		{
+			reset();
+			moveFrom(other);
+		}
+		return *this;
+	}
+
+	UniqueTask(const UniqueTask&) = delete;
+	UniqueTask& operator=(const UniqueTask&) = delete;
+
+	~UniqueTask()
+	{
+		reset();
+	}
+
+	void operator()()
+	{
+		ops_->call(buffer_);
+	}
+
+	explicit operator bool() const
+	{
+		return ops_ != nullptr;
+	}
+private:
+	// 按照可调用对象的类型生成的操作表
+	struct Ops
+	{
+		void (*call)(void*);
+		void (*move)(void* dst, void* src);
+		void (*destroy)(void*);
+	};
+
+	template<typename F>
+	static constexpr Ops inlineOps = {
+		[](void* p) { (*static_cast<F*>(p))(); },
+		[](void* dst, void* src) {
+			new (dst) F(std::move(*static_cast<F*>(src)));
+			static_cast<F*>(src)->~F();
+		},
+		[](void* p) { static_cast<F*>(p)->~F(); }
+	};
+
+	template<typename F>
+	static constexpr Ops heapOps = {
+		[](void* p) { (**static_cast<F**>(p))(); },
+		[](void* dst, void* src) { *static_cast<F**>(dst) = *static_cast<F**>(src); },
+		[](void* p) { delete *static_cast<F**>(p); }
+	};
+
+	void moveFrom(UniqueTask& other)
+	{
+		ops_ = other.ops_;
+		if (ops_ != nullptr)
+			ops_->move(buffer_, other.buffer_);
+		other.ops_ = nullptr;
+	}
+
+	void reset()
+	{
+		if (ops_ != nullptr)
+			ops_->destroy(buffer_);
+		ops_ = nullptr;
+	}
+
+	static constexpr size_t BUFFER_SIZE = 48;
+	alignas(std::max_align_t) unsigned char buffer_[BUFFER_SIZE];
+	const Ops* ops_ = nullptr;
+};
+
+// 用连续内存实现的环形队列，满了按两倍扩容，稳定之后入队出队不再分配内存
+template<typename T, size_t InitCapacity>
+class RingQueue
+{
+public:
+	RingQueue()
+		: buffer_(roundUp(InitCapacity))
+		, head_(0)
+		, size_(0)
+	{}
+
+	void push(T&& data)
+	{
+		if (size_ == buffer_.size())
+			grow();
+		buffer_[(head_ + size_) & (buffer_.size() - 1)] = std::move(data);
+		size_++;
+	}
+
+	T& front()
+	{
+		return buffer_[head_];
+	}
+
+	void pop()
+	{
+		buffer_[head_] = T();	// 尽早释放任务持有的资源
+		head_ = (head_ + 1) & (buffer_.size() - 1);
+		size_--;
+	}
+
+	bool empty() const
+	{
+		return size_ == 0;
+	}
+
+	size_t size() const
+	{
+		return size_;
+	}
+private:
+	static size_t roundUp(size_t capacity)
+	{
+		size_t size = 2;
+		while (size < capacity)
+			size <<= 1;
+		return size;
+	}
+
+	void grow()
+	{
+		std::vector<T> buffer(buffer_.size() * 2);
+		for (size_t i = 0; i < size_; ++i)
+		{
+			buffer[i] = std::move(buffer_[(head_ + i) & (buffer_.size() - 1)]);
+		}
+		buffer_.swap(buffer);
+		head_ = 0;
+	}
+
+	std::vector<T> buffer_;
+	size_t head_;
+	size_t size_;
+};
+
+// 任务队列策略：每个租户的任务队列用什么容器
+// 线程池用一把锁保护所有队列，所以这里的容器不需要是线程安全的
+struct StdQueuePolicy
+{
+	template<typename T>
+	using Queue = std::queue<T>;
+};
+
+template<size_t InitCapacity = 1024>
+struct RingQueuePolicy
+{
+	template<typename T>
+	using Queue = RingQueue<T, InitCapacity>;
+};
+
+// 空闲策略：没有任务时线程怎么等待
+// 直接在条件变量上睡眠
+struct ParkIdlePolicy
+{
+	static constexpr int spinCount = 0;
+};
+
+// 先在锁外自旋SpinCount次等待新任务，等不到再睡眠，适合任务密集、对延迟敏感的场景
+template<int SpinCount = 2000>
+struct SpinParkIdlePolicy
+{
+	static constexpr int spinCount = SpinCount;
+};
+
+// 统计策略：是否记录任务等待时间、任务编号、正在执行的任务，以及是否输出调试信息
+// 关闭后租户的getStats和看门狗不可用
+struct DefaultStatsPolicy
+{
+	static constexpr bool isEnabled = true;
+};
+
+struct NoStatsPolicy
+{
+	static constexpr bool isEnabled = false;
+};
+
+// 线程池类型，通过模板参数在编译期选择任务队列、空闲等待方式、任务类型和是否统计
+// 不需要的功能在编译期去掉，不会有运行时的判断
+template<typename QueuePolicy = StdQueuePolicy,
+	typename IdlePolicy = ParkIdlePolicy,
+	typename TaskType = std::function<void()>,
+	typename StatsPolicy = DefaultStatsPolicy>
+class BasicThreadPool
+{
+private:
+	using Task = TaskType;											// 任务类型
+	using Clock = std::chrono::high_resolution_clock;
+
+	// 队列中的任务，记录入队时间用于统计等待时间
+	struct TaskItem
+	{
+		Task task_;
+		Clock::time_point enqueueTime_;
+		uint64_t taskId_;
+	};
+
+	// 线程正在执行的任务，受taskQueMtx_保护，看门狗据此检查执行时间过长的任务
+	struct WorkerState
+	{
+		uint64_t taskId_ = 0;			// 正在执行的任务编号，0表示空闲
+		Clock::time_point startTime_;	// 任务开始执行的时间
+		bool isReported_ = false;		// 是否已经报告过看门狗
+		bool isCompensated_ = false;	// 是否已经为这个任务创建了补偿线程
+		std::thread::id tid_;			// 系统线程id
+	};
+
+	// 租户的任务队列，线程池按照DRR(deficit round robin)在各个租户之间轮转取任务
+	struct TenantQueue
+	{
+		TenantQueue(int weight, int maxRunning)
+			: weight_(weight)
+			, maxRunning_(maxRunning)
+		{}
+
+		typename QueuePolicy::template Queue<TaskItem> taskQue_;	// 租户自己的任务队列
+		int weight_;					// 每一轮可以取的任务数量
+		int maxRunning_;				// 同时执行的任务数量上限，0表示不限制
+		int runningSize_ = 0;			// 正在执行的任务数量
+		int deficit_ = 0;				// 本轮剩余的配额
+		bool isReady_ = false;			// 是否在readyTenants_中
+		bool isClosed_ = false;			// 句柄是否已经全部销毁，队列空了并且没有任务在执行时从tenants_删除
+		typename std::list<TenantQueue>::iterator self_;	// 在tenants_中的位置
+
+		uint64_t finishedSize_ = 0;		// 已经执行完的任务数量
+		uint64_t takenSize_ = 0;		// 已经出队的任务数量
+		Clock::duration totalWait_{};	// 出队任务的等待时间总和
+		Clock::duration maxWait_{};		// 出队任务的最长等待时间
+	};
+
+public:
+	// 租户句柄，通过createTenant创建，可以随意拷贝
+	// 每个租户有自己的队列，一个租户提交大量任务不会饿死其他租户的任务
+	// 最后一个句柄销毁后租户关闭，剩下的任务照常执行，执行完后释放租户；句柄需要在线程池析构之前销毁
+	class Tenant
+	{
+	public:
+		// 给租户提交任务
+		template<typename Func, typename... Args>
+		auto submitTask(Func&& func, Args&&... args) -> std::future<decltype(func(args...))>
+		{
+			using RType = decltype(func(args...));
+			return pool_->template submitPackaged<RType>(*queue_,
+				std::bind(std::forward<Func>(func), std::forward<Args>(args)...));
+		}
+
+		// 给租户提交可以取消的任务
+		template<typename Func, typename... Args>
+		auto submitTask(const CancelToken& token, Func&& func, Args&&... args) -> std::future<decltype(func(args...))>
+		{
+			using RType = decltype(func(args...));
+			return pool_->template submitPackaged<RType>(*queue_, makeCancellable<RType>(token,
+				std::bind(std::forward<Func>(func), std::forward<Args>(args)...)));
+		}
+
+		// 设置租户的权重，每一轮可以取weight个任务
+		void setWeight(int weight)
+		{
+			std::unique_lock<std::mutex> lock(pool_->taskQueMtx_);
+			queue_->weight_ = std::max(weight, 1);
+		}
+
+		// 设置租户同时执行的任务数量上限，0表示不限制
+		void setMaxRunning(int maxRunning)
+		{
+			std::unique_lock<std::mutex> lock(pool_->taskQueMtx_);
+			pool_->untrackTenant(*queue_);
+			queue_->maxRunning_ = std::max(maxRunning, 0);
+			pool_->trackTenant(*queue_);
+			if (pool_->isTenantCapped(*queue_))
+				pool_->unreadyTenant(*queue_);
+			else if (pool_->readyTenant(*queue_))
+				pool_->notifyIdle();
+		}
+
+		// 获取租户的队列深度和等待时间统计
+		TenantStats getStats() const
+		{
+			static_assert(StatsPolicy::isEnabled, "getStats needs StatsPolicy::isEnabled");
+			std::unique_lock<std::mutex> lock(pool_->taskQueMtx_);
+			TenantStats stats;
+			stats.queueSize = queue_->taskQue_.size();
+			stats.runningSize = queue_->runningSize_;
+			stats.finishedSize = queue_->finishedSize_;
+			stats.avgWaitMs = queue_->takenSize_ == 0 ? 0.0 :
+				std::chrono::duration<double, std::milli>(queue_->totalWait_).count() / queue_->takenSize_;
+			stats.maxWaitMs = std::chrono::duration<double, std::milli>(queue_->maxWait_).count();
+			return stats;
+		}
+	private:
+		friend class BasicThreadPool;
+		Tenant(BasicThreadPool* pool, TenantQueue* queue)
+			: pool_(pool)
+			, queue_(queue, [pool](TenantQueue* queue) { pool->closeTenant(*queue); })
+		{}
+
+		BasicThreadPool* pool_;
+		std::shared_ptr<TenantQueue> queue_;	// 不拥有租户，最后一个句柄销毁时关闭租户
+	};
+
+	// 任务中执行可能长时间阻塞的操作（磁盘IO、等锁等）时，在阻塞操作外面构造一个BlockingRegion
+	// 线程池没有空闲线程时会临时创建一个补偿线程，阻塞结束后补偿线程在空闲时退出
+	// 可以嵌套使用，只有最外层生效；不在线程池的线程中使用时什么也不做
+	class BlockingRegion
+	{
+	public:
+		BlockingRegion()
+			: pool_(blockingDepth_++ == 0 ? currentPool_ : nullptr)
+			, isCompensated_(false)
+		{
+			if (pool_ != nullptr)
+				isCompensated_ = pool_->beginBlocking();
+		}
+
+		~BlockingRegion()
+		{
+			blockingDepth_--;
+			if (isCompensated_)
+				pool_->endBlocking();
+		}
+
+		BlockingRegion(const BlockingRegion&) = delete;
+		BlockingRegion& operator=(const BlockingRegion&) = delete;
+	private:
+		BasicThreadPool* pool_;
+		bool isCompensated_;
+	};
+
+	BasicThreadPool()
 		: initThreadSize_(0)
 		, idleThreadSize_(0)
 		, curThreadSize_(0)
 		, threadMaxThreshHold_(THREAD_MAX_THRESHHOLD)
+		, exitThreadSize_(0)
+		, compensateSize_(0)
 		, taskSize_(0)
+		, taskIdGen_(0)
 		, taskQueMaxThreshHold_(TASK_MAX_THRESHHOLD)
 		, poolMode_(PoolMode::MODE_FIXED)
 		, isPoolRunning_(false)
-	{}
+	{
+		// 直接通过线程池提交的任务都属于默认租户
+		tenants_.emplace_back(1, 0);
+		defaultTenant_ = &tenants_.back();
+	}
 
-	~ThreadPool()
+	~BasicThreadPool()
 	{
-		isPoolRunning_ = false;
+		shutdown(ShutdownMode::MODE_DRAIN);
+
+		// 停止看门狗线程
+		{
+			std::unique_lock<std::mutex> lock(taskQueMtx_);
+			isWatchdogExit_ = true;
+			watchdogCond_.notify_all();
+		}
+		if (watchdog_.joinable())
+			watchdog_.join();
+
+		// 先停止补充备用线程，再让剩下的备用线程退出
+		{
+			std::unique_lock<std::mutex> lock(taskQueMtx_);
+			isStandbyExit_ = true;
+			spawnerCond_.notify_all();
+		}
+		if (spawner_.joinable())
+			spawner_.join();
+		{
+			std::unique_lock<std::mutex> lock(taskQueMtx_);
+			standbyCond_.notify_all();
+			exitCond_.wait(lock, [this]() { return standbyThreads_.empty(); });
+			joinThreads(lock);
+		}
+
+#ifdef __linux__
+		if (epollFd_ >= 0)
+		{
+			close(wakeFd_);
+			close(epollFd_);
+		}
+#endif
+	}
+
+	// 设置线程池的工作模式
+	void setMode(PoolMode mode)
+	{
+		std::unique_lock<std::mutex> lock(taskQueMtx_);
+		poolMode_ = mode;
+		if (!checkRunningState())
+			return;
+
+		// 运行中切换回fixed模式，cached模式下额外创建的线程需要退出
+		if (poolMode_ == PoolMode::MODE_FIXED)
+			adjustThreadSize(initThreadSize_);
+		// 唤醒空闲线程，按照新的模式重新等待任务
+		notifyIdle();
+	}
+
+	// 设置线程池cached模式下线程阈值，不低于核心线程数量（setThreadSize/start设置的数量）
+	void setThreadMaxThreshHold(int threshhold)
+	{
+		std::unique_lock<std::mutex> lock(taskQueMtx_);
+		// 阈值不能低于核心线程数量，否则调低阈值会让核心线程也退出，之后没有线程执行任务
+		threshhold = std::max(threshhold, std::max(static_cast<int>(initThreadSize_), 1));
+		threadMaxThreshHold_ = threshhold;
+		if (!checkRunningState())
+			return;
+
+		// 阈值调低后，超出阈值的线程需要退出
+		if (poolMode_ == PoolMode::MODE_CACHED
+			&& curThreadSize_ - exitThreadSize_ > threshhold)
+			adjustThreadSize(threshhold);
+	}
+
+	// 设置task任务队列上限阈值
+	void setTaskQueMaxThreshHold(int threshhold)
+	{
+		std::unique_lock<std::mutex> lock(taskQueMtx_);
+		taskQueMaxThreshHold_ = threshhold;
+		// 阈值调高后，唤醒阻塞在提交任务上的用户线程
+		notFull_.notify_all();
+	}
+
+	// 设置线程池的线程数量，运行中调用会立即扩容或缩容
+	void setThreadSize(int threadSize)
+	{
+		if (threadSize < 1)
+			threadSize = 1;
+
+		std::unique_lock<std::mutex> lock(taskQueMtx_);
+		initThreadSize_ = threadSize;
+		if (!checkRunningState())
+			return;
+		adjustThreadSize(threadSize);
+	}
 
+	// 给线程池提交任务
+	// 使用可变参模板编程，让submitTask可以接受任意任务函数和任意数量的参数
+	template<typename Func, typename... Args>
+	auto submitTask(Func&& func, Args&&... args) -> std::future<decltype(func(args...))>
+	{
+		// 打包任务，放到默认租户的任务队列
+		using RType = decltype(func(args...));
+		return submitPackaged<RType>(*defaultTenant_,
+			std::bind(std::forward<Func>(func), std::forward<Args>(args)...));
+	}
+
+	// 给线程池提交可以取消的任务，同一个token提交的任务可以通过token.cancel()一起取消
+	// 已经取消的任务出队时不会执行，对应的future会抛出TaskCancelled异常
+	template<typename Func, typename... Args>
+	auto submitTask(const CancelToken& token, Func&& func, Args&&... args) -> std::future<decltype(func(args...))>
+	{
+		using RType = decltype(func(args...));
+		return submitPackaged<RType>(*defaultTenant_, makeCancellable<RType>(token,
+			std::bind(std::forward<Func>(func), std::forward<Args>(args)...)));
+	}
+
+	// 创建一个租户，weight是每一轮可以取的任务数量，maxRunning限制同时执行的任务数量（0表示不限制）
+	Tenant createTenant(int weight = 1, int maxRunning = 0)
+	{
+		std::unique_lock<std::mutex> lock(taskQueMtx_);
+		tenants_.emplace_back(std::max(weight, 1), std::max(maxRunning, 0));
+		tenants_.back().self_ = std::prev(tenants_.end());
+		return Tenant(this, &tenants_.back());
+	}
+
+	// 开启线程池，关闭之后可以再次调用start重新开启
+	// 创建线程失败时抛出std::system_error，已经创建的线程继续工作；一个线程都没有创建成功时线程池保持关闭
+	void start(int initThreadSize = THREAD_SIZE)
+	{
+		std::unique_lock<std::mutex> lock(taskQueMtx_);
+		if (checkRunningState())
+			return;
+		isPoolRunning_ = true;
+		initThreadSize_ = initThreadSize;
+		exitThreadSize_ = 0;
+		compensateSize_ = 0;
+
+		// 新线程在start返回、释放锁之后才开始取任务
+		try
+		{
+			for (int i = 0; i < initThreadSize; ++i)
+			{
+				addThread();
+			}
+		}
+		catch (const std::system_error&)
+		{
+			if (curThreadSize_ == 0)
+				isPoolRunning_ = false;
+			throw;
+		}
+	}
+
+	// 设置之后创建的线程的参数：栈大小、大页和预先缺页的栈、线程名、调度策略和nice值
+	// 预先缺页只对备用线程生效，其他线程在持有锁时创建，不能在锁内写一遍整个线程栈
+	// standbySize大于0时，后台线程会预先创建这么多挂起的备用线程（使用同样的参数），
+	// start、cached模式扩容和补偿线程优先唤醒备用线程，不需要在锁内创建线程，随后在锁外补充
+	// 调小standbySize时已经创建的备用线程不会退出，直到线程池析构
+	void setThreadOptions(const ThreadOptions& options)
+	{
+		std::unique_lock<std::mutex> lock(taskQueMtx_);
+		threadOptions_ = options;
+		if (options.standbySize > 0 && !spawner_.joinable())
+			spawner_ = std::thread(&BasicThreadPool::spawnerFunc, this);
+		spawnerCond_.notify_all();
+	}
+
+	// 设置线程初始化回调，参数是线程池内部的线程编号
+	// 每个线程（包括cached模式下后来创建的线程和补偿线程）开始取任务之前，在线程中执行一次
+	// 适合创建每个线程的资源，例如WorkerLocal中的缓冲区、压缩上下文；只对之后创建的线程生效
+	void setThreadInitFunc(std::function<void(int)> func)
+	{
 		std::unique_lock<std::mutex> lock(taskQueMtx_);
+		threadInitFunc_ = std::move(func);
+	}
+
+	// 设置线程退出回调，参数是线程池内部的线程编号
+	// 线程退出之前在线程中执行一次，执行时不持有线程池的锁
+	void setThreadExitFunc(std::function<void(int)> func)
+	{
+		std::unique_lock<std::mutex> lock(taskQueMtx_);
+		threadExitFunc_ = std::move(func);
+	}
+
+	// 开启看门狗，任务执行时间超过threshold时调用handler报告（每个任务只报告一次）
+	// compensate为true时，还会为卡住的线程创建补偿线程，直到这个任务执行完
+	// handler在看门狗线程中调用，调用时不持有线程池的锁
+	void setStallWatchdog(std::chrono::milliseconds threshold,
+		std::function<void(const StallInfo&)> handler, bool compensate = false)
+	{
+		static_assert(StatsPolicy::isEnabled, "setStallWatchdog needs StatsPolicy::isEnabled");
+		std::unique_lock<std::mutex> lock(taskQueMtx_);
+		stallThreshold_ = std::max(threshold, std::chrono::milliseconds(1));
+		stallHandler_ = std::move(handler);
+		isStallCompensate_ = compensate;
+		if (!watchdog_.joinable())
+			watchdog_ = std::thread(&BasicThreadPool::watchdogFunc, this);
+		watchdogCond_.notify_all();
+	}
+
+	// 开启IO reactor（仅Linux，基于epoll），成功返回true
+	// 开启后空闲线程轮流负责epoll_wait，fd就绪时把回调作为任务放回线程池执行，不需要额外的IO线程
+	bool enableReactor()
+	{
+#ifdef __linux__
+		std::unique_lock<std::mutex> lock(taskQueMtx_);
+		if (epollFd_ >= 0)
+			return true;
+
+		int epollFd = epoll_create1(EPOLL_CLOEXEC);
+		if (epollFd < 0)
+			return false;
+		int wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if (wakeFd < 0)
+		{
+			close(epollFd);
+			return false;
+		}
+		epoll_event ev{};
+		ev.events = EPOLLIN;
+		ev.data.fd = wakeFd;
+		if (epoll_ctl(epollFd, EPOLL_CTL_ADD, wakeFd, &ev) < 0)
+		{
+			close(wakeFd);
+			close(epollFd);
+			return false;
+		}
+		epollFd_ = epollFd;
+		wakeFd_ = wakeFd;
+		// 让已经在notEmpty_上等待的线程去负责epoll_wait
 		notEmpty_.notify_all();
+		return true;
+#else
+		return false;
+#endif
+	}
+
+	// 等待fd上的事件（EPOLLIN、EPOLLOUT等），就绪后把callback(就绪的事件)作为任务提交到线程池
+	// 只触发一次，需要继续等待时在callback中再次调用watchFd；需要先调用enableReactor
+	// callback抛出的异常会被捕获并打印到std::cerr，不影响线程池继续运行
+	bool watchFd(int fd, uint32_t events, std::function<void(uint32_t)> callback)
+	{
+#ifdef __linux__
+		std::unique_lock<std::mutex> lock(taskQueMtx_);
+		if (epollFd_ < 0 || fd < 0)
+			return false;
+
+		epoll_event ev{};
+		ev.events = events | EPOLLONESHOT;
+		ev.data.fd = fd;
+		// 之前等待过的fd已经在epoll中，用MOD重新打开；fd关闭过的话内核已经移除了，再ADD
+		// 其他错误（例如fd已经关闭时的EBADF）说明回调永远不会触发，返回false
+		bool isAdd = ioWatches_.find(fd) == ioWatches_.end();
+		if (!isAdd && epoll_ctl(epollFd_, EPOLL_CTL_MOD, fd, &ev) < 0)
+		{
+			if (errno != ENOENT)
+				return false;
+			isAdd = true;
+		}
+		if (isAdd && epoll_ctl(epollFd_, EPOLL_CTL_ADD, fd, &ev) < 0)
+			return false;
+		ioWatches_[fd] = std::move(callback);
+		return true;
+#else
+		return false;
+#endif
+	}
+
+	// 取消等待fd，关闭fd之前调用；已经就绪放入队列的回调仍然会执行
+	void unwatchFd(int fd)
+	{
+#ifdef __linux__
+		std::unique_lock<std::mutex> lock(taskQueMtx_);
+		if (ioWatches_.erase(fd) > 0)
+			epoll_ctl(epollFd_, EPOLL_CTL_DEL, fd, nullptr);
+#endif
+	}
+
+	// 关闭线程池，返回没有执行就被丢弃的任务数量
+	// 不能在线程池的任务中调用，否则会一直等待自己退出
+	size_t shutdown(ShutdownMode mode = ShutdownMode::MODE_DRAIN)
+	{
+		std::unique_lock<std::mutex> lock(taskQueMtx_);
+		stopThreads();
+
+		size_t discardSize = 0;
+		if (mode == ShutdownMode::MODE_CANCEL)
+			discardSize = discardTasks(lock);
+
 		exitCond_.wait(lock, [this]() -> bool {
 			return threads_.empty();
 			});
+		joinThreads(lock);
+		return discardSize;
+	}
+
+	// 关闭线程池，最多等待timeout让线程执行队列中剩余的任务，超时后丢弃剩余的任务
+	// 返回没有执行就被丢弃的任务数量
+	template<typename Rep, typename Period>
+	size_t shutdownFor(std::chrono::duration<Rep, Period> timeout)
+	{
+		std::unique_lock<std::mutex> lock(taskQueMtx_);
+		stopThreads();
+
+		size_t discardSize = 0;
+		if (!exitCond_.wait_for(lock, timeout, [this]() -> bool {
+			return threads_.empty();
+			}))
+		{
+			// 超时后丢弃还没有开始的任务，正在执行的任务无法打断，只能等待其结束
+			discardSize = discardTasks(lock);
+			exitCond_.wait(lock, [this]() -> bool {
+				return threads_.empty();
+				});
+		}
+		joinThreads(lock);
+		return discardSize;
 	}
 
-	// 设置线程池的工作模式
-	void setMode(PoolMode mode)
-	{
-		if (checkRunningState())
-			return;
-		poolMode_ = mode;
-	}
+	// 禁止拷贝和赋值
+	BasicThreadPool(const BasicThreadPool&) = delete;
+	BasicThreadPool& operator=(const BasicThreadPool&) = delete;
 
-	// 设置线程池cached模式下线程阈值
-	void setThreadMaxThreshHold(int threshhold)
+private:
+	// 打包任务并放到租户的任务队列，返回任务的future
+	template<typename RType, typename Func>
+	std::future<RType> submitPackaged(TenantQueue& tenant, Func&& func)
 	{
-		if (checkRunningState())
-			return;
-		if (poolMode_ == PoolMode::MODE_CACHED)
-			threadMaxThreshHold_ = threshhold;
+		std::packaged_task<RType()> task(std::forward<Func>(func));
+		std::future<RType> result = task.get_future();
+
+		bool isSubmitted;
+		if constexpr (std::is_copy_constructible_v<Task>)
+		{
+			// std::function要求可以拷贝，packaged_task只能移动，用shared_ptr包一层
+			auto sp = std::make_shared<std::packaged_task<RType()>>(std::move(task));
+			isSubmitted = enqueueTask(tenant, [sp]() {
+				(*sp)();
+				});
+		}
+		else
+		{
+			isSubmitted = enqueueTask(tenant, std::move(task));
+		}
+
+		if (!isSubmitted)
+			return failedFuture<RType>();
+		return result;
 	}
 
-	// 设置task任务队列上限阈值
-	void setTaskQueMaxThreshHold(int threshhold)
+	// 包装可以取消的任务，已经取消的任务出队时不执行，直接让future抛出TaskCancelled
+	template<typename RType, typename Func>
+	static auto makeCancellable(const CancelToken& token, Func&& func)
 	{
-		if (checkRunningState())
-			return;
-		taskQueMaxThreshHold_ = threshhold;
+		return [token, f = std::forward<Func>(func)]() mutable -> RType {
+			if (token.isCancelled())
+				throw TaskCancelled();
+			return f();
+		};
 	}
 
-	// 给线程池提交任务
-	// 使用可变参模板编程，让submitTask可以接受任意任务函数和任意数量的参数
-	template<typename Func, typename... Args>
-	auto submitTask(Func&& func, Args&&... args) -> std::future<decltype(func(args...))>
+	// 把任务放到租户的任务队列，队列满了等待一秒钟还没有空余则返回false
+	bool enqueueTask(TenantQueue& tenant, Task task)
 	{
-		// 打包任务，放到任务队列
-		using RType = decltype(func(args...));
-		auto task = std::make_shared<std::packaged_task<RType()>>(
-			std::bind(std::forward<Func>(func), std::forward<Args>(args)...));
-		std::future<RType> result = task->get_future();
-
 		// 获取锁
 		std::unique_lock<std::mutex> lock(taskQueMtx_);
 		// 用户提交任务，最长不能阻塞一秒钟，否则提交任务失败，返回
+		// 所有租户共用taskQueMaxThreshHold_这个上限
 		if (!notFull_.wait_for(lock, std::chrono::seconds(1),
 			[this]() -> bool {
-				return taskQue_.size() < taskQueMaxThreshHold_;
+				return taskSize_ < taskQueMaxThreshHold_;
 			}))
 		{
 			std::cerr << "task queue is full, submit task fail" << std::endl;
-			// 任务失败了返回一个空的
-			auto task = std::make_shared<std::packaged_task<RType()>>(
-				[]() -> RType {
-					return RType();
-				});
-			(*task)();
-			return task->get_future();
+			return false;
 		}
 
-			// 如果有空余，把任务放到任务队列
-			taskQue_.emplace([task]() {
-				(*task)();
-				});
-			taskSize_++;
-
-			// 因为新放了任务，任务队列肯定不为空，再用notEmpty_通知
-			notEmpty_.notify_all();
+		// 如果有空余，把任务放到租户的任务队列
+		pushTask(tenant, std::move(task));
 
-			// cached模式下，如果任务数量超过了空闲线程的数量并且当前线程的数量是小于我们设置的线程最大数量，就会创建新的线程去执行任务
-			if (poolMode_ == PoolMode::MODE_CACHED
-				&& taskSize_ > idleThreadSize_
-				&& curThreadSize_ < threadMaxThreshHold_)
-			{
-				std::cout << ">>> create new thread threadId: " << std::this_thread::get_id() << std::endl;
-				auto ptr = std::make_unique<Thread>(std::bind(&ThreadPool::threadFunc, this, std::placeholders::_1));
-				int threadId = ptr->getId();
-				threads_.emplace(threadId, std::move(ptr));
-				threads_[threadId]->start();
-				curThreadSize_++;
-			}
-			return result;
+		// 顺便回收已经退出的线程，线程退出时会执行thread_local（例如WorkerLocal）的析构函数，
+		// 可能很慢甚至会访问线程池，必须在锁外join
+		if (!exitThreads_.empty())
+			joinThreads(lock);
+		return true;
 	}
 
-	// 开启线程池
-	void start(int initThreadSize = THREAD_SIZE)
+	// 把任务放到租户的任务队列并通知空闲线程，调用前需持有taskQueMtx_
+	void pushTask(TenantQueue& tenant, Task task)
 	{
-		isPoolRunning_ = true;
-		initThreadSize_ = initThreadSize;
-		curThreadSize_ = initThreadSize;
+		untrackTenant(tenant);
+		if constexpr (StatsPolicy::isEnabled)
+			tenant.taskQue_.push(TaskItem{ std::move(task), Clock::now(), ++taskIdGen_ });
+		else
+			tenant.taskQue_.push(TaskItem{ std::move(task), Clock::time_point(), 0 });
+		taskSize_++;
+		trackTenant(tenant);
+		readyTenant(tenant);
 
-		for (int i = 0; i < initThreadSize; ++i)
-		{
-			auto ptr = std::make_unique<Thread>(std::bind(&ThreadPool::threadFunc, this, std::placeholders::_1));
-			int threadId = ptr->getId();
-			threads_.emplace(threadId, std::move(ptr));
-			curThreadSize_++;
-			idleThreadSize_++;
-		}
+		// 因为新放了任务，任务队列肯定不为空，再用notEmpty_通知
+		notEmpty_.notify_all();
+		// 在notEmpty_上等待的线程不够取走所有任务时，才需要唤醒正在epoll_wait的线程来执行任务
+		// 不能用idleThreadSize_判断，已经被通知但还没取到任务的线程仍然算作空闲
+		if (taskSize_ > static_cast<unsigned>(waitingSize_))
+			wakeReactor();
 
-		for (auto& [threadId, thread] : threads_)
+		// cached模式下，如果可以执行的任务数量超过了空闲线程的数量并且当前线程的数量是小于我们设置的线程最大数量，就会创建新的线程去执行任务
+		// 达到并发上限的租户的任务暂时不能执行，不算在内，否则会为它们创建用不上的线程
+		if (poolMode_ == PoolMode::MODE_CACHED
+			&& readyTaskSize_ > static_cast<size_t>(std::max<int>(idleThreadSize_, 0))
+			&& curThreadSize_ < threadMaxThreshHold_)
 		{
-			thread->start();
+			if constexpr (StatsPolicy::isEnabled)
+				std::cout << ">>> create new thread threadId: " << std::this_thread::get_id() << std::endl;
+			// 任务已经放进队列，创建线程失败时由现有的线程执行，不影响这次提交
+			try
+			{
+				addThread();
+			}
+			catch (const std::system_error&)
+			{
+			}
 		}
 	}
 
-	// 禁止拷贝和赋值
-	ThreadPool(const ThreadPool&) = delete;
-	ThreadPool& operator=(const ThreadPool&) = delete;
+	// 提交任务失败了返回一个空的结果
+	template<typename RType>
+	static std::future<RType> failedFuture()
+	{
+		auto task = std::make_shared<std::packaged_task<RType()>>(
+			[]() -> RType {
+				return RType();
+			});
+		(*task)();
+		return task->get_future();
+	}
 
-private:
 	// 定义线程函数
 	void threadFunc(int threadId)
 	{
 		auto lastTime = std::chrono::high_resolution_clock().now();
+		TenantQueue* lastTenant = nullptr;	// 上一个任务所属的租户
+		WorkerState* state = nullptr;		// 当前线程的状态，unordered_map的元素地址不会变化
+		std::function<void(int)> initFunc;
+		{
+			std::unique_lock<std::mutex> lock(taskQueMtx_);
+			state = &workerStates_[threadId];
+			state->tid_ = std::this_thread::get_id();
+			initFunc = threadInitFunc_;
+		}
+		currentPool_ = this;
+
+		// 在锁外执行线程初始化回调
+		if (initFunc)
+			initFunc(threadId);
 
 
 		while (true)
@@ -207,60 +1157,73 @@ private:
 			// 先获取锁
 			std::unique_lock<std::mutex> lock(taskQueMtx_);
 
-			std::cout << "tid: " << std::this_thread::get_id() << " 尝试获取任务..." << std::endl;
+			// 上一个任务已经执行完，趁持有锁更新租户的状态，不需要额外加锁
+			if (lastTenant != nullptr)
+			{
+				finishTask(*lastTenant, *state);
+				lastTenant = nullptr;
+			}
+
+			if constexpr (StatsPolicy::isEnabled)
+				std::cout << "tid: " << std::this_thread::get_id() << " 尝试获取任务..." << std::endl;
 
 
-			while (taskQue_.empty())
+			while (readyTenants_.empty() || exitThreadSize_ > 0)
 			{
+				// 线程池缩容，当前线程手上没有任务，直接退出，队列中的任务留给其他线程
+				if (exitThreadSize_ > 0)
+				{
+					exitThreadSize_--;
+					removeThread(lock, threadId);
+					if constexpr (StatsPolicy::isEnabled)
+						std::cout << "threadid: " << std::this_thread::get_id() << " exit" << std::endl;
+					return;
+				}
+
 				// 回收线程资源
 				if (!isPoolRunning_)
 				{
-					threads_.erase(threadId);
-					exitCond_.notify_all();
+					removeThread(lock, threadId);
 					return;
 				}
 
 				// 如果是cached模式，会根据现在空闲线程等待的时间，如果超过设定的60s，会自动回收线程
+				// 直接等到空闲超时的时间点，关闭线程池时会被notify_all唤醒，不需要轮询
 				if (poolMode_ == PoolMode::MODE_CACHED)
 				{
 					// 表明等待超时
-					if (std::cv_status::timeout ==
-						notEmpty_.wait_for(lock, std::chrono::seconds(1)))
+					if (!waitTask(lock, lastTime + std::chrono::seconds(THREAD_MAX_IDLE_TIME)))
 					{
-						auto now = std::chrono::high_resolution_clock().now();
-						auto dur = std::chrono::duration_cast<std::chrono::seconds>(now - lastTime);
-						if (dur.count() >= THREAD_MAX_IDLE_TIME
-							&& curThreadSize_ > initThreadSize_)
+						if (curThreadSize_ > initThreadSize_)
 						{
 							// 回收线程资源
-							threads_.erase(threadId);
-							// 修改其他属性
-							curThreadSize_--;
-							idleThreadSize_--;
-							std::cout << "threadid: " << std::this_thread::get_id() << " exit" << std::endl;
+							removeThread(lock, threadId);
+							if constexpr (StatsPolicy::isEnabled)
+								std::cout << "threadid: " << std::this_thread::get_id() << " exit" << std::endl;
 							return;
 						}
+						// 核心线程不回收，重新计时
+						lastTime = std::chrono::high_resolution_clock().now();
 					}
 				}
 				else
 				{
 					// 等待
-					notEmpty_.wait(lock);
+					waitTask(lock, Clock::time_point::max());
 				}
 
 			}
 
 			idleThreadSize_--;
 
-			std::cout << "tid: " << std::this_thread::get_id() << " 获取任务成功!" << std::endl;
+			if constexpr (StatsPolicy::isEnabled)
+				std::cout << "tid: " << std::this_thread::get_id() << " 获取任务成功!" << std::endl;
 
-			// 从任务队列取一个任务
-			task = taskQue_.front();
-			taskQue_.pop();
-			taskSize_--;
+			// 按照DRR从租户的任务队列取一个任务
+			lastTenant = takeTask(task, *state);
 
 			// 取出任务，继续通知其他线程继续提交任务
-			if (taskQue_.size() > 0)
+			if (taskSize_ > 0)
 			{
 				notFull_.notify_all();
 			}
@@ -282,16 +1245,544 @@ private:
 	{
 		return isPoolRunning_;
 	}
+
+	// 空闲线程等待新任务，超时返回false，deadline为time_point::max()表示一直等待
+	// 开启reactor后，第一个空闲的线程负责epoll_wait，其他空闲线程在notEmpty_上等待
+	bool waitTask(std::unique_lock<std::mutex>& lock, Clock::time_point deadline)
+	{
+#ifdef __linux__
+		if (epollFd_ >= 0 && !isPolling_)
+			return pollReactor(lock, deadline);
+#endif
+		if constexpr (IdlePolicy::spinCount > 0)
+		{
+			// 先在锁外自旋等一会，任务很快到来时不用经过条件变量的睡眠和唤醒
+			lock.unlock();
+			for (int i = 0; i < IdlePolicy::spinCount && taskSize_.load(std::memory_order_relaxed) == 0; ++i)
+			{
+				std::this_thread::yield();
+			}
+			lock.lock();
+			// 自旋期间的通知已经错过了，重新持有锁后检查一遍再睡眠
+			if (!readyTenants_.empty() || !isPoolRunning_ || exitThreadSize_ > 0)
+				return true;
+		}
+
+		waitingSize_++;
+		bool isNotified = true;
+		if (deadline == Clock::time_point::max())
+			notEmpty_.wait(lock);
+		else
+			isNotified = notEmpty_.wait_until(lock, deadline) != std::cv_status::timeout;
+		waitingSize_--;
+		return isNotified;
+	}
+
+	// 唤醒所有空闲线程，包括正在epoll_wait的线程，调用前需持有taskQueMtx_
+	void notifyIdle()
+	{
+		notEmpty_.notify_all();
+		wakeReactor();
+	}
+
+	// 从readyTenants_队头的租户取一个任务，返回任务所属的租户，调用前需持有taskQueMtx_
+	// 只有一个租户有任务时，只是多了几次整数运算，不会有额外的开销
+	TenantQueue* takeTask(Task& task, WorkerState& state)
+	{
+		TenantQueue* tenant = readyTenants_.front();
+		// 每一轮给租户补充weight_个任务的配额
+		if (tenant->deficit_ <= 0)
+			tenant->deficit_ += tenant->weight_;
+
+		untrackTenant(*tenant);
+		TaskItem& item = tenant->taskQue_.front();
+		if constexpr (StatsPolicy::isEnabled)
+		{
+			auto now = Clock::now();
+			auto wait = now - item.enqueueTime_;
+			tenant->totalWait_ += wait;
+			tenant->maxWait_ = std::max(tenant->maxWait_, wait);
+			tenant->takenSize_++;
+			state.taskId_ = item.taskId_;
+			state.startTime_ = now;
+		}
+		task = std::move(item.task_);
+		tenant->taskQue_.pop();
+		tenant->deficit_--;
+		tenant->runningSize_++;
+		taskSize_--;
+
+		if (tenant->taskQue_.empty() || isTenantCapped(*tenant))
+		{
+			// 没有任务了或者达到并发上限，移出轮转，等任务执行完再放回来
+			readyTenants_.pop_front();
+			tenant->isReady_ = false;
+			if (tenant->taskQue_.empty())
+				tenant->deficit_ = 0;
+		}
+		else if (tenant->deficit_ <= 0 && readyTenants_.size() > 1)
+		{
+			// 本轮配额用完，轮到下一个租户
+			readyTenants_.pop_front();
+			readyTenants_.push_back(tenant);
+		}
+		trackTenant(*tenant);
+		return tenant;
+	}
+
+	// 租户的任务执行完成，调用前需持有taskQueMtx_
+	void finishTask(TenantQueue& tenant, WorkerState& state)
+	{
+		// 卡住的任务终于执行完了，补偿线程可以退出了
+		if (state.isCompensated_)
+			releaseCompensation();
+		state.taskId_ = 0;
+		state.isReported_ = false;
+		state.isCompensated_ = false;
+
+		untrackTenant(tenant);
+		tenant.runningSize_--;
+		tenant.finishedSize_++;
+		trackTenant(tenant);
+		readyTenant(tenant);
+		removeTenant(tenant);
+	}
+
+	// 关闭租户，最后一个句柄销毁时调用
+	void closeTenant(TenantQueue& tenant)
+	{
+		std::unique_lock<std::mutex> lock(taskQueMtx_);
+		tenant.isClosed_ = true;
+		removeTenant(tenant);
+	}
+
+	// 已经关闭的租户没有任务了就从tenants_删除，调用前需持有taskQueMtx_
+	void removeTenant(TenantQueue& tenant)
+	{
+		if (tenant.isClosed_ && tenant.taskQue_.empty() && tenant.runningSize_ == 0)
+			tenants_.erase(tenant.self_);
+	}
+
+	// 租户是否达到了并发上限
+	bool isTenantCapped(const TenantQueue& tenant) const
+	{
+		return tenant.maxRunning_ > 0 && tenant.runningSize_ >= tenant.maxRunning_;
+	}
+
+	// 租户有任务并且没有达到并发上限时加入轮转，返回是否新加入，调用前需持有taskQueMtx_
+	bool readyTenant(TenantQueue& tenant)
+	{
+		if (tenant.isReady_ || tenant.taskQue_.empty() || isTenantCapped(tenant))
+			return false;
+		readyTenants_.push_back(&tenant);
+		tenant.isReady_ = true;
+		trackTenant(tenant);
+		return true;
+	}
+
+	// 租户马上可以执行的任务数量：队列中的任务数量，不超过离并发上限还差的数量
+	static size_t runnableSize(const TenantQueue& tenant)
+	{
+		size_t size = tenant.taskQue_.size();
+		if (tenant.maxRunning_ > 0)
+			size = std::min<size_t>(size, std::max(tenant.maxRunning_ - tenant.runningSize_, 0));
+		return size;
+	}
+
+	// 修改轮转中的租户的队列、并发数量或者上限之前调用untrackTenant，修改之后调用trackTenant，
+	// 让readyTaskSize_保持为轮转中所有租户的runnableSize之和，调用前需持有taskQueMtx_
+	void untrackTenant(const TenantQueue& tenant)
+	{
+		if (tenant.isReady_)
+			readyTaskSize_ -= runnableSize(tenant);
+	}
+
+	void trackTenant(const TenantQueue& tenant)
+	{
+		if (tenant.isReady_)
+			readyTaskSize_ += runnableSize(tenant);
+	}
+
+	// 把租户移出轮转，调用前需持有taskQueMtx_
+	void unreadyTenant(TenantQueue& tenant)
+	{
+		if (!tenant.isReady_)
+			return;
+		untrackTenant(tenant);
+		readyTenants_.erase(std::find(readyTenants_.begin(), readyTenants_.end(), &tenant));
+		tenant.isReady_ = false;
+	}
+
+	// 创建并启动一个新线程，调用前需持有taskQueMtx_
+	// 创建失败时抛出std::system_error，线程池的状态不变
+	void addThread()
+	{
+		if (!standbyThreads_.empty())
+		{
+			// 直接唤醒一个备用线程，并通知后台线程在锁外补充
+			auto it = standbyThreads_.begin();
+			int threadId = it->first;
+			threads_.emplace(threadId, std::move(it->second));
+			standbyThreads_.erase(it);
+			workerStates_.emplace(threadId, WorkerState());
+			standbyCond_.notify_all();
+			spawnerCond_.notify_all();
+		}
+		else
+		{
+			// 先启动再加入threads_，启动失败不会留下没有运行的线程，让shutdown一直等待
+			// 新线程要等释放锁之后才能读取workerStates_
+			// 这里持有锁，不预先写线程栈（默认8MB约2000次缺页），只有在锁外创建的备用线程才预先缺页
+			ThreadOptions options = threadOptions_;
+			options.isPrefaultStack = false;
+			auto ptr = std::make_unique<Thread>([this](int threadId) { threadFunc(threadId); });
+			ptr->start(options);
+			int threadId = ptr->getId();
+			threads_.emplace(threadId, std::move(ptr));
+			workerStates_.emplace(threadId, WorkerState());
+		}
+		curThreadSize_++;
+		idleThreadSize_++;
+	}
+
+	// 线程退出时修改线程数量，在锁外执行退出回调，再把线程对象移到exitThreads_等待join
+	// 调用前需持有taskQueMtx_，返回时仍然持有
+	void removeThread(std::unique_lock<std::mutex>& lock, int threadId)
+	{
+		curThreadSize_--;
+		idleThreadSize_--;
+
+		// 执行回调时线程还在threads_中，shutdown会等待回调结束
+		if (threadExitFunc_)
+		{
+			auto exitFunc = threadExitFunc_;
+			lock.unlock();
+			exitFunc(threadId);
+			lock.lock();
+		}
+
+		auto it = threads_.find(threadId);
+		exitThreads_.emplace_back(std::move(it->second));
+		threads_.erase(it);
+		workerStates_.erase(threadId);
+		exitCond_.notify_all();
+	}
+
+	// 标记线程池停止并唤醒所有线程，调用前需持有taskQueMtx_
+	void stopThreads()
+	{
+		isPoolRunning_ = false;
+		exitThreadSize_ = 0;
+		notifyIdle();
+		notFull_.notify_all();
+	}
+
+	// 丢弃队列中还没有执行的任务，返回丢弃的数量，调用前需持有taskQueMtx_，中间会暂时释放锁
+	// 任务对象析构后，对应的future会得到std::future_error(broken_promise)，不会一直阻塞
+	size_t discardTasks(std::unique_lock<std::mutex>& lock)
+	{
+		size_t discardSize = taskSize_;
+		std::vector<Task> discarded;
+		discarded.reserve(discardSize);
+		for (auto it = tenants_.begin(); it != tenants_.end();)
+		{
+			TenantQueue& tenant = *it++;
+			while (!tenant.taskQue_.empty())
+			{
+				discarded.push_back(std::move(tenant.taskQue_.front().task_));
+				tenant.taskQue_.pop();
+			}
+			tenant.isReady_ = false;
+			tenant.deficit_ = 0;
+			removeTenant(tenant);
+		}
+		readyTenants_.clear();
+		readyTaskSize_ = 0;
+		taskSize_ = 0;
+		notFull_.notify_all();
+
+		// 任务可能持有租户的句柄，销毁时会关闭租户、需要加锁，所以在锁外销毁
+		lock.unlock();
+		discarded.clear();
+		lock.lock();
+		return discardSize;
+	}
+
+	// 在锁外join所有已经退出的线程
+	void joinThreads(std::unique_lock<std::mutex>& lock)
+	{
+		std::vector<std::unique_ptr<Thread>> exitThreads;
+		exitThreads.swap(exitThreads_);
+		lock.unlock();
+		exitThreads.clear();
+	}
+
+	// 任务进入阻塞区域，返回是否创建了补偿线程
+	bool beginBlocking()
+	{
+		std::unique_lock<std::mutex> lock(taskQueMtx_);
+		return compensate();
+	}
+
+	// 任务离开阻塞区域，让补偿线程退出
+	void endBlocking()
+	{
+		std::unique_lock<std::mutex> lock(taskQueMtx_);
+		releaseCompensation();
+	}
+
+	// 有线程被阻塞时临时创建一个补偿线程，返回是否创建，调用前需持有taskQueMtx_
+	// 还有空闲线程或者线程数量达到threadMaxThreshHold_时不补偿
+	bool compensate()
+	{
+		if (!checkRunningState()
+			|| idleThreadSize_ > 0
+			|| curThreadSize_ >= threadMaxThreshHold_)
+			return false;
+		if constexpr (StatsPolicy::isEnabled)
+			std::cout << ">>> create compensate thread" << std::endl;
+		try
+		{
+			addThread();
+		}
+		catch (const std::system_error&)
+		{
+			return false;
+		}
+		compensateSize_++;
+		return true;
+	}
+
+	// 阻塞结束，让一个补偿线程在空闲时退出，调用前需持有taskQueMtx_
+	void releaseCompensation()
+	{
+		if (compensateSize_ <= 0)
+			return;
+		compensateSize_--;
+		exitThreadSize_++;
+		notifyIdle();
+	}
+
+	// 唤醒正在epoll_wait的线程，调用前需持有taskQueMtx_
+	void wakeReactor()
+	{
+#ifdef __linux__
+		if (isPolling_)
+		{
+			uint64_t one = 1;
+			(void)write(wakeFd_, &one, sizeof(one));
+		}
+#endif
+	}
+
+#ifdef __linux__
+	// 当前线程释放锁去epoll_wait，把就绪fd的回调放到默认租户的任务队列，超时返回false
+	bool pollReactor(std::unique_lock<std::mutex>& lock, Clock::time_point deadline)
+	{
+		int timeoutMs = -1;
+		if (deadline != Clock::time_point::max())
+		{
+			auto left = std::chrono::ceil<std::chrono::milliseconds>(deadline - Clock::now());
+			timeoutMs = static_cast<int>(std::max<long long>(left.count(), 0));
+		}
+
+		isPolling_ = true;
+		lock.unlock();
+		epoll_event events[64];
+		int n = epoll_wait(epollFd_, events, 64, timeoutMs);
+		lock.lock();
+		isPolling_ = false;
+
+		for (int i = 0; i < n; ++i)
+		{
+			int fd = events[i].data.fd;
+			if (fd == wakeFd_)
+			{
+				uint64_t count;
+				(void)read(wakeFd_, &count, sizeof(count));
+				continue;
+			}
+
+			// 回调已经被unwatchFd取消，或者已经触发过还没有重新等待
+			auto it = ioWatches_.find(fd);
+			if (it == ioWatches_.end() || !it->second)
+				continue;
+			uint32_t ready = events[i].events;
+			// 回调没有future可以保存异常，在这里捕获，不能让异常逃出线程函数终止进程
+			pushTask(*defaultTenant_, [callback = std::move(it->second), ready]() {
+				try
+				{
+					callback(ready);
+				}
+				catch (const std::exception& e)
+				{
+					std::cerr << "watchFd callback throws: " << e.what() << std::endl;
+				}
+				catch (...)
+				{
+					std::cerr << "watchFd callback throws an unknown exception" << std::endl;
+				}
+				});
+			it->second = nullptr;
+		}
+
+		// 当前线程可能要去执行任务了，唤醒一个空闲线程接着负责epoll_wait
+		notEmpty_.notify_one();
+		return n != 0;
+	}
+#endif
+
+	// 备用线程函数，挂起直到addThread把它移到threads_，之后和普通线程一样取任务
+	void standbyFunc(int threadId)
+	{
+		{
+			std::unique_lock<std::mutex> lock(taskQueMtx_);
+			standbyCond_.wait(lock, [&]() {
+				return threads_.count(threadId) > 0
+					|| (isStandbyExit_ && standbyThreads_.count(threadId) > 0);
+				});
+
+			// 线程池析构，没有被唤醒过的备用线程直接退出
+			if (threads_.count(threadId) == 0)
+			{
+				auto it = standbyThreads_.find(threadId);
+				exitThreads_.emplace_back(std::move(it->second));
+				standbyThreads_.erase(it);
+				exitCond_.notify_all();
+				return;
+			}
+		}
+		threadFunc(threadId);
+	}
+
+	// 后台补充备用线程，创建线程（clone、分配和预先缺页线程栈）都在锁外完成
+	void spawnerFunc()
+	{
+		std::unique_lock<std::mutex> lock(taskQueMtx_);
+		while (!isStandbyExit_)
+		{
+			if (static_cast<int>(standbyThreads_.size()) >= threadOptions_.standbySize)
+			{
+				spawnerCond_.wait(lock);
+				// 刚唤醒的备用线程要马上执行任务，稍等再补充，避免clone和它们抢CPU
+				spawnerCond_.wait_for(lock, std::chrono::milliseconds(THREAD_STANDBY_REFILL_DELAY),
+					[this]() { return isStandbyExit_; });
+				continue;
+			}
+
+			ThreadOptions options = threadOptions_;
+			lock.unlock();
+			auto ptr = std::make_unique<Thread>([this](int threadId) { standbyFunc(threadId); });
+			bool isStarted = true;
+			try
+			{
+				ptr->start(options);
+			}
+			catch (const std::system_error&)
+			{
+				isStarted = false;
+			}
+			lock.lock();
+
+			if (!isStarted)
+			{
+				// 创建失败（例如达到了系统的线程上限），等下一次唤醒备用线程时再重试
+				spawnerCond_.wait(lock);
+				continue;
+			}
+			int threadId = ptr->getId();
+			standbyThreads_.emplace(threadId, std::move(ptr));
+		}
+	}
+
+	// 看门狗线程函数，每隔stallThreshold_的一半检查一次所有线程正在执行的任务
+	void watchdogFunc()
+	{
+		std::unique_lock<std::mutex> lock(taskQueMtx_);
+		while (!isWatchdogExit_)
+		{
+			// 用微秒计算检查周期，阈值为1ms时除以2不会截断成0导致空转
+			watchdogCond_.wait_for(lock, std::chrono::microseconds(stallThreshold_) / 2);
+
+			auto now = Clock::now();
+			std::vector<StallInfo> stalls;
+			for (auto& [threadId, state] : workerStates_)
+			{
+				if (state.taskId_ == 0 || state.isReported_
+					|| now - state.startTime_ < stallThreshold_)
+					continue;
+
+				state.isReported_ = true;
+				stalls.push_back(StallInfo{ state.taskId_,
+					std::chrono::duration_cast<std::chrono::milliseconds>(now - state.startTime_),
+					threadId, state.tid_ });
+				if (isStallCompensate_ && compensate())
+					state.isCompensated_ = true;
+			}
+
+			// 报告的时候不持有锁，handler里面可以调用线程池的接口
+			if (!stalls.empty() && stallHandler_)
+			{
+				auto handler = stallHandler_;
+				lock.unlock();
+				for (auto& stall : stalls)
+				{
+					handler(stall);
+				}
+				lock.lock();
+			}
+		}
+	}
+
+	// 把线程数量调整到threadSize，多余的线程标记为待退出，调用前需持有taskQueMtx_
+	// 补偿线程不算在内，它们会在阻塞结束后自己退出
+	void adjustThreadSize(int threadSize)
+	{
+		int liveSize = curThreadSize_ - exitThreadSize_ - compensateSize_;
+		if (threadSize > liveSize)
+		{
+			// 先撤销还没来得及退出的名额，不够再创建新线程
+			int diff = threadSize - liveSize;
+			int revoke = std::min(diff, exitThreadSize_);
+			exitThreadSize_ -= revoke;
+			for (int i = revoke; i < diff; ++i)
+			{
+				addThread();
+			}
+		}
+		else if (threadSize < liveSize)
+		{
+			// 正在执行任务的线程会在任务结束后退出，不会丢失任务
+			exitThreadSize_ += liveSize - threadSize;
+			notifyIdle();
+		}
+	}
 private:
 	std::unordered_map<int, std::unique_ptr<Thread>> threads_;		// 线程列表
+	std::vector<std::unique_ptr<Thread>> exitThreads_;				// 已经退出、等待join的线程
 	size_t initThreadSize_;											// 初始的线程数量
 	std::atomic_int curThreadSize_;									// 记录当前线程池的线程数量
 	std::atomic_int idleThreadSize_;								// 空闲线程的数量
 	size_t threadMaxThreshHold_;									// 线程数量上限的阈值
+	int exitThreadSize_;											// 等待退出的线程数量（受taskQueMtx_保护）
+	int compensateSize_;											// 因为任务阻塞临时创建的补偿线程数量（受taskQueMtx_保护）
+	std::unordered_map<int, WorkerState> workerStates_;				// 每个线程正在执行的任务
+	std::function<void(int)> threadInitFunc_;						// 线程初始化回调
+	std::function<void(int)> threadExitFunc_;						// 线程退出回调
+	ThreadOptions threadOptions_;									// 创建线程的参数
 
-	using Task = std::function<void()>;								// 任务类型 
-	std::queue<Task> taskQue_;										// 任务队列
-	std::atomic_uint taskSize_;										// 任务的数量
+	std::unordered_map<int, std::unique_ptr<Thread>> standbyThreads_;	// 已经创建、挂起等待唤醒的备用线程
+	std::thread spawner_;											// 补充备用线程的后台线程，setThreadOptions时启动
+	std::condition_variable spawnerCond_;							// 备用线程被唤醒后通知后台线程补充
+	std::condition_variable standbyCond_;							// 唤醒备用线程
+	bool isStandbyExit_ = false;									// 备用线程和后台线程是否退出
+
+	std::list<TenantQueue> tenants_;								// 所有租户的任务队列，租户关闭并且执行完任务后删除
+	TenantQueue* defaultTenant_;									// 默认租户，直接通过线程池提交的任务放在这里
+	std::deque<TenantQueue*> readyTenants_;							// 有任务可以执行的租户，按照DRR轮转
+	size_t readyTaskSize_ = 0;										// readyTenants_中的租户马上可以执行的任务数量（受taskQueMtx_保护）
+	std::atomic_uint taskSize_;										// 所有租户中任务的数量
+	uint64_t taskIdGen_;											// 任务编号生成器（受taskQueMtx_保护）
 	size_t taskQueMaxThreshHold_;									// 任务数量上限的阈值
 
 	std::mutex taskQueMtx_;											// 保证任务队列的线程安全
@@ -301,4 +1792,23 @@ private:
 
 	PoolMode poolMode_;												// 当前线程池的工作模式
 	std::atomic_bool isPoolRunning_;								// 表示线程池的启动状态
-};
\ No newline at end of file
+
+	std::thread watchdog_;											// 看门狗线程，setStallWatchdog时启动
+	std::condition_variable watchdogCond_;							// 唤醒看门狗线程退出
+	std::chrono::milliseconds stallThreshold_{ 0 };					// 任务执行时间超过这个值就报告
+	std::function<void(const StallInfo&)> stallHandler_;			// 报告卡住任务的回调
+	bool isStallCompensate_ = false;								// 是否为卡住的任务创建补偿线程
+	bool isWatchdogExit_ = false;									// 看门狗线程是否退出
+
+	int epollFd_ = -1;												// reactor的epoll，-1表示没有开启
+	int wakeFd_ = -1;												// 用来唤醒epoll_wait的eventfd
+	bool isPolling_ = false;										// 是否有线程正在epoll_wait（受taskQueMtx_保护）
+	int waitingSize_ = 0;											// 在notEmpty_上等待的线程数量（受taskQueMtx_保护）
+	std::unordered_map<int, std::function<void(uint32_t)>> ioWatches_;	// 每个fd就绪后要执行的回调（受taskQueMtx_保护）
+
+	static inline thread_local BasicThreadPool* currentPool_ = nullptr;	// 当前线程所属的线程池
+	static inline thread_local int blockingDepth_ = 0;				// 当前线程BlockingRegion的嵌套深度
+};
+
+// 默认的线程池类型
+using ThreadPool = BasicThreadPool<>;